@@ -0,0 +1,138 @@
+/** Benchmark for the board kernels in blocks.c.
+
+Times every specialized kernel against the generic one for the same shape
+on random boards, checks that both give the same answer, and times
+clearAndScore for the game's own shape. See bench/compile.sh. */
+
+#define BLOCKS_NO_MAIN
+#include "../blocks.c"
+#undef main
+
+#define BENCH_BOARDS 256
+#define MAX_CELLS    (MAX_BOARD_WIDTH * MAX_BOARD_HEIGHT)
+
+Uint8  boards[BENCH_BOARDS][MAX_CELLS];
+Uint8  work[MAX_CELLS];
+Uint8  settled[MAX_CELLS];
+Uint32 marksA[MAX_BOARD_WIDTH];
+Uint32 marksB[MAX_BOARD_WIDTH];
+
+// Keeps the compiler from dropping kernel results
+volatile int sink;
+
+/** Random boards with three colors and about one empty cell in four, so
+there are plenty of matches and things to settle */
+void fillBoards(int cellCount, Uint32 seed) {
+  int b, i;
+  for(b=0; b < BENCH_BOARDS; b++) {
+    for(i=0; i < cellCount; i++) {
+      seed ^= seed << 13;
+      seed ^= seed >> 17;
+      seed ^= seed << 5;
+      boards[b][i] = (seed >> 8) % 4;
+    }
+  }
+}
+
+/** Nanoseconds per board for one kernel over all boards, iterations times */
+double timeMatches(BoardKernel* k, int generic, long iterations) {
+  double start = hires_time_in_seconds();
+  long   it;
+
+  for(it=0; it < iterations; it++) {
+    const Uint8* board = boards[it % BENCH_BOARDS];
+    if(generic) findMatchesGeneric(board, marksA, k->w, k->h, k->match);
+    else        k->findMatches(board, marksA);
+    sink += marksA[it % k->w];
+  }
+
+  return (hires_time_in_seconds() - start) * 1e9 / iterations;
+}
+
+double timeSettle(BoardKernel* k, int generic, long iterations) {
+  int    cells = k->w * k->h;
+  double start = hires_time_in_seconds();
+  long   it;
+
+  for(it=0; it < iterations; it++) {
+    memcpy(work, boards[it % BENCH_BOARDS], cells);
+    if(generic) sink += settleGeneric(work, k->w, k->h);
+    else        sink += k->settle(work);
+  }
+
+  return (hires_time_in_seconds() - start) * 1e9 / iterations;
+}
+
+/** Specialized and generic kernels must agree on every board */
+int checkKernel(BoardKernel* k) {
+  int cells = k->w * k->h;
+  int b;
+
+  for(b=0; b < BENCH_BOARDS; b++) {
+    k->findMatches(boards[b], marksA);
+    findMatchesGeneric(boards[b], marksB, k->w, k->h, k->match);
+    if(memcmp(marksA, marksB, k->w * sizeof(Uint32)) != 0) return false;
+
+    memcpy(work,    boards[b], cells);
+    memcpy(settled, boards[b], cells);
+    k->settle(work);
+    settleGeneric(settled, k->w, k->h);
+    if(memcmp(work, settled, cells) != 0) return false;
+  }
+  return true;
+}
+
+int main(int argc, char* argv[]) {
+  long iterations = argc > 1 ? atol(argv[1]) : 2000000;
+  int  failed     = false;
+  int  i;
+
+  printf("%-14s %-12s %12s %12s %8s\n", "shape", "kernel", "specialized", "generic", "speedup");
+
+  for(i=0; i < NUM_BOARD_KERNELS; i++) {
+    BoardKernel* k = &boardKernels[i];
+    fillBoards(k->w * k->h, 1234 + i);
+
+    if(!checkKernel(k)) {
+      printf("%-14s specialized and generic kernels disagree\n", k->name);
+      failed = true;
+      continue;
+    }
+
+    double s = timeMatches(k, false, iterations);
+    double g = timeMatches(k, true,  iterations);
+    printf("%-14s %-12s %9.1f ns %9.1f ns %7.2fx\n", k->name, "findMatches", s, g, g / s);
+
+    s = timeSettle(k, false, iterations);
+    g = timeSettle(k, true,  iterations);
+    printf("%-14s %-12s %9.1f ns %9.1f ns %7.2fx\n", k->name, "settle", s, g, g / s);
+  }
+
+  // The whole clear for the game's own shape, through the dispatch
+  initGameState();
+  fillBoards(GRID_BLOCK_WIDTH * GRID_BLOCK_HEIGHT, 99);
+
+  long   rounds = iterations / 10;
+  double start  = hires_time_in_seconds();
+  long   it;
+  int    x, y;
+
+  for(it=0; it < rounds; it++) {
+    const Uint8* board = boards[it % BENCH_BOARDS];
+    for(x=0; x < GRID_BLOCK_WIDTH; x++) {
+      for(y=0; y < GRID_BLOCK_HEIGHT; y++) {
+        Uint8 c = board[x*GRID_BLOCK_HEIGHT + y];
+        placedBlocks[x][y].occupied = c != 0;
+        placedBlocks[x][y].color    = c ? tileColors[c-1] : COLOR_BLACK;
+      }
+    }
+    clearAndScore();
+  }
+
+  printf("%dx%d match %d   clearAndScore %6.1f ns (%s kernel, includes board setup)\n",
+         GRID_BLOCK_WIDTH, GRID_BLOCK_HEIGHT, BLOCKS_TO_MATCH,
+         (hires_time_in_seconds() - start) * 1e9 / rounds,
+         boardKernel ? "specialized" : "generic");
+
+  return failed ? 1 : 0;
+}
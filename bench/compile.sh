@@ -0,0 +1,5 @@
+#!/bin/bash
+# Builds the board kernel benchmark at -O2, like the game's compile.sh.
+# Set CFLAGS to time the kernels under other flags.
+cd "$(dirname "$0")"
+${CC:-gcc} ${CFLAGS--O2} `sdl-config --cflags` board_bench.c `sdl-config --libs` -o board_bench
@@ -1,10 +1,22 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <SDL.h>
 #include <sys/time.h>
 #include <math.h>
+#include <signal.h>
+
+#include "dataset.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #define BPP                 4
 #define DEPTH               32
+#define VIDEO_FLAGS         (SDL_RESIZABLE|SDL_HWSURFACE)
 #define FPS                 100
 
 #define GRID_BLOCK_HEIGHT   14
@@ -13,6 +25,31 @@
 #define BLOCK_WIDTH         50
 #define BLOCK_COLUMN_LENGTH 3
 #define BLOCKS_TO_MATCH     3
+#define NUM_TILES           6
+#define TILE_BEVEL          (BLOCK_WIDTH/10)
+
+#define FONT_WIDTH          5
+#define FONT_HEIGHT         7
+#define FONT_SCALE          2
+#define GLYPH_WIDTH         ((FONT_WIDTH+1) * FONT_SCALE)
+#define GLYPH_HEIGHT        ((FONT_HEIGHT+1) * FONT_SCALE)
+#define HUD_LINES           3
+#define HUD_TEXT_LENGTH     16
+#define HUD_MARGIN          4
+
+#define MAX_PARTICLES       8192
+#define PARTICLES_PER_BLOCK 40
+#define PARTICLE_LIFE       .9f
+#define PARTICLE_GRAVITY    900.0f
+
+#define CAPTURE_POOL_SIZE   8
+
+#define DATASET_BLOCK_RECORDS 4096
+#define SIMULATE_EXPLORE      4
+
+#define TIMER_WHEEL_SLOTS   64
+#define TIMER_TICK          .001
+#define MAX_TIMERS          16
 
 // Constants
 const int GRID_HEIGHT = GRID_BLOCK_HEIGHT * BLOCK_HEIGHT;
@@ -22,39 +59,84 @@ const int GRID_WIDTH  = GRID_BLOCK_WIDTH * BLOCK_WIDTH;
 const char* title = "Blocks!";
 
 ///////////////////////////////////////////////////////////////////////////////
-// Linked List for tracking blocks to remove when clearing
+// Board Kernels
+//
+// Match finding and gravity on a plain grid of color ids (0 = empty),
+// column major like placedBlocks. Every kernel is written once against a
+// board shape (board_kernels.h) and stamped out with the shape as constants
+// and the loops unrolled for the shapes we ship. Anything else goes through
+// the generic versions.
 ///////////////////////////////////////////////////////////////////////////////
 
-struct rem_list_el {
-  int x;
-  int y;
-  struct rem_list_el* next;
-};
-
-typedef struct rem_list_el BlockRemItem;
+#define MAX_BOARD_WIDTH  32
+#define MAX_BOARD_HEIGHT 32    // Rows of a column fit in a Uint32
+#define MAX_CELL_COLOR   7     // Highest color id in a board
+
+#if GRID_BLOCK_WIDTH > MAX_BOARD_WIDTH || GRID_BLOCK_HEIGHT > MAX_BOARD_HEIGHT
+#error "The board kernels only handle boards up to 32x32"
+#endif
+
+#define KERNEL_INLINE static inline __attribute__((always_inline))
+#define KERNEL_NOINLINE __attribute__((noinline))
+
+// findMatchesShape and settleShape, loops unrolled once the shape is constant
+#define KERNEL_NAME(name) name##Shape
+#define KERNEL_UNROLL     _Pragma("GCC unroll 32")
+#include "board_kernels.h"
+#undef KERNEL_NAME
+#undef KERNEL_UNROLL
+
+// findMatchesLoop and settleLoop for any shape
+#define KERNEL_NAME(name) name##Loop
+#define KERNEL_UNROLL
+#include "board_kernels.h"
+#undef KERNEL_NAME
+#undef KERNEL_UNROLL
+
+KERNEL_NOINLINE void findMatchesGeneric(const Uint8* cells, Uint32* marks, int w, int h, int match) {
+  findMatchesLoop(cells, marks, w, h, match);
+}
 
-void addItemToRemList(BlockRemItem* head, BlockRemItem* next) {
-  // Iterate over head to make sure we hit the end of the list before adding
-  BlockRemItem* curr = head;
-  while(1) {
-    if(curr->next == NULL) {
-      curr->next = next;
-      break;
-    }
-    curr = curr->next;
-    //printf("Looking for the end!\n");
-  }    
+KERNEL_NOINLINE int settleGeneric(Uint8* cells, int w, int h) {
+  return settleLoop(cells, w, h);
 }
 
-int getItemToRemListLength(BlockRemItem* head) {
-  int len = 0;
-  BlockRemItem* curr = head;
-  while(curr) {
-    len++;
-    curr = curr->next;
-  }    
+#define BOARD_KERNEL(w, h, match)                                           \
+  void findMatches##w##x##h##m##match(const Uint8* cells, Uint32* marks) {  \
+    findMatchesShape(cells, marks, w, h, match);                            \
+  }                                                                         \
+  int settle##w##x##h##m##match(Uint8* cells) {                             \
+    return settleShape(cells, w, h);                                        \
+  }
 
-  return len;
+BOARD_KERNEL(6, 14, 3)
+BOARD_KERNEL(8, 16, 4)
+
+typedef struct {
+  const char* name;
+  int         w;
+  int         h;
+  int         match;
+  void        (*findMatches)(const Uint8*, Uint32*);
+  int         (*settle)(Uint8*);
+} BoardKernel;
+
+#define NUM_BOARD_KERNELS 2
+
+BoardKernel boardKernels[NUM_BOARD_KERNELS] = {
+  {"6x14 match 3", 6, 14, 3, findMatches6x14m3, settle6x14m3},
+  {"8x16 match 4", 8, 16, 4, findMatches8x16m4, settle8x16m4},
+};
+
+/** The specialized kernels for a board shape, NULL if there are none */
+BoardKernel* selectBoardKernel(int w, int h, int match) {
+  int i;
+  for(i=0; i < NUM_BOARD_KERNELS; i++) {
+    if(boardKernels[i].w == w && boardKernels[i].h == h && boardKernels[i].match == match) {
+      return &boardKernels[i];
+    }
+  }
+  return NULL;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -70,6 +152,133 @@ typedef struct {
   int *color;
 } Block;
 
+// Recording of presented frames. The game thread only copies pixels into a
+// free pool buffer, the writer thread converts and streams them out.
+typedef struct {
+  FILE*           out;
+  int             isPipe;
+  int             rgba;          // Raw RGBA instead of Y4M
+  int             failed;        // Set by the writer when output breaks
+  int             w;
+  int             h;
+  int             rowBytes;
+  SDL_PixelFormat format;        // Copy of the screen format at start
+  Uint8*          frames[CAPTURE_POOL_SIZE];
+  int             freeFrames[CAPTURE_POOL_SIZE];
+  int             freeCount;
+  int             queued[CAPTURE_POOL_SIZE];
+  int             queueHead;
+  int             queueCount;
+  Uint8*          scratch;       // Writer side conversion buffer
+  SDL_mutex*      lock;
+  SDL_cond*       ready;
+  SDL_Thread*     thread;
+  int             stopping;
+  long            written;
+  long            dropped;
+} FrameCapture;
+
+// A block's worth of placements, one array per dataset column
+typedef struct {
+  Uint8  board[DATASET_BLOCK_RECORDS * GRID_BLOCK_WIDTH * GRID_BLOCK_HEIGHT];
+  Uint8  piece[DATASET_BLOCK_RECORDS * BLOCK_COLUMN_LENGTH];
+  Uint8  column[DATASET_BLOCK_RECORDS];
+  Uint8  rotation[DATASET_BLOCK_RECORDS];
+  Uint16 cleared[DATASET_BLOCK_RECORDS];
+  Uint8  chain[DATASET_BLOCK_RECORDS];
+  Uint8  ended[DATASET_BLOCK_RECORDS];
+  int    records;
+} DatasetBuffer;
+
+// Export of every placement, see dataset.h. Placements are appended to one
+// buffer while the writer thread encodes and writes out the other.
+typedef struct {
+  FILE*          out;
+  DatasetHeader  header;
+  DatasetBuffer* buffers[2];
+  int            filling;       // Buffer placements go into
+  int            pending;       // Buffer handed to the writer, -1 for none
+  Uint8*         scratch;       // Writer side board encoding
+  int            failed;        // Set by the writer when output breaks
+  SDL_mutex*     lock;
+  SDL_cond*      ready;         // Something is pending or we're stopping
+  SDL_cond*      done;          // The writer is done with the pending buffer
+  SDL_Thread*    thread;
+  int            stopping;
+  long           records;
+  long           blocks;
+  long           bytes;
+} DatasetWriter;
+
+// A deadline on the timer wheel. Periodic timers re-arm themselves after
+// firing, one shot timers have an interval of 0.
+typedef void (*TimerCallback)(double);
+
+struct timer_el {
+  int              active;
+  double           deadline;
+  double           interval;
+  long             tick;       // Wheel tick the deadline falls in
+  TimerCallback    callback;
+  struct timer_el* next;       // Next timer in the same slot
+};
+
+typedef struct timer_el Timer;
+
+// Hashed timer wheel. Timers hash into slots by tick and each slot is only
+// looked at when its tick comes round, so checking costs nothing until
+// something is due.
+typedef struct {
+  double start;
+  long   currentTick;          // Last tick that has been run
+  Timer* slots[TIMER_WHEEL_SLOTS];
+  Timer  pool[MAX_TIMERS];
+} TimerWheel;
+
+// A line of HUD text and its cached rendering
+typedef struct {
+  char         text[HUD_TEXT_LENGTH];
+  SDL_Surface* surface;
+} HudLine;
+
+// Score and friends drawn over the board. Lines are only rasterized when
+// their text changes and are composed into a single surface, so an
+// unchanged HUD is one blit.
+typedef struct {
+  SDL_Surface* glyphs;         // Every FONT_CHARS glyph, side by side
+  SDL_Surface* surface;        // All lines composed
+  Uint32       key;            // Transparent color
+  HudLine      lines[HUD_LINES];
+  int          dirty;          // A line changed since the last compose
+} Hud;
+
+// Fixed pool of particles, one array per field so the update runs four
+// particles at a time. Live particles are kept packed at the front.
+typedef struct {
+  int    count;
+  Uint32 seed;                  // Own random stream, rand() drives the game
+  double lastUpdate;
+  float  x[MAX_PARTICLES];
+  float  y[MAX_PARTICLES];
+  float  vx[MAX_PARTICLES];
+  float  vy[MAX_PARTICLES];
+  float  life[MAX_PARTICLES];   // Seconds left
+  Uint32 pixel[MAX_PARTICLES];  // Color in the backbuffer's format
+} Particles;
+
+// Lookup tables for presenting the fixed size backbuffer in a window of any
+// size. Only rebuilt when the window size changes.
+typedef struct {
+  int      w;
+  int      h;
+  int      scale;         // Integer scale factor, 0 when shrinking
+  SDL_Rect dst;           // Where the board lands in the window
+  int*     colMap;        // Backbuffer column for every window column in dst
+  int*     rowMap;        // Backbuffer row for every window row in dst
+  Uint32*  row;           // One scaled row, built in system memory
+  int      clearBorders;  // Presents left that still need the borders cleared
+} ScaleTables;
+
 ///////////////////////////////////////////////////////////////////////////////
 // Function declarations
 ///////////////////////////////////////////////////////////////////////////////
@@ -79,9 +288,26 @@ void   initGameState();
 void   spawnColumn();
 void   drawRect(SDL_Surface*, int, int, int, int, int*);
 void   renderBlock(SDL_Surface*, Block);
+Uint8  shadeChannel(int, int);
+int    tileIndex(int*);
+void   buildTileAtlas();
+SDL_Surface* createHudSurface(int, int);
+void   buildHud();
+void   freeHud();
+void   setHudText(int, const char*);
+void   updateHud();
+void   drawHud(SDL_Surface*);
+void   countFrames(double);
+float  particleRandom();
+void   spawnParticles(int, int, int*);
+void   updateParticles(double);
+void   drawParticles(SDL_Surface*);
 void   renderColumn(SDL_Surface*);
 void   renderPlacedBlocks(SDL_Surface*);
 void   DrawScreen(SDL_Surface*);
+void   buildScaleTables(SDL_Surface*);
+void   replicateRow(Uint32*, const Uint32*, int, int);
+void   presentBackbuffer(SDL_Surface*);
 double hires_time_in_seconds();
 float  min(double, double);
 void   moveColumnDown(double);
@@ -92,6 +318,31 @@ void   moveColumnLeft();
 void   compactBlocks(double);
 void   shiftColumnColors();
 void   clearAndScore();
+void   boardCells(Uint8*);
+Uint8  cellColor(int*);
+void   findMatches(const Uint8*, Uint32*);
+int    settleCells(Uint8*);
+void   initTimers(double);
+Timer* addTimer(double, double, TimerCallback);
+void   scheduleTimer(Timer*);
+void   runTimers(double);
+double nextTimerDeadline();
+void   renderFrame(double);
+int    startCapture(const char*, int, SDL_Surface*);
+void   captureFrame(SDL_Surface*);
+int    captureWriter(void*);
+void   stopCapture();
+int    startDataset(const char*);
+void   recordPlacement(const Uint8*, const Uint8*, int, int, int, int, int);
+void   recordLanding(const Uint8*, int, int, int);
+void   queueDatasetBuffer();
+int    datasetWriter(void*);
+void   writeDatasetBlock(DatasetBuffer*);
+Uint8  recordDelta(const Uint8*, int, int);
+int    encodeXorRle(const Uint8*, int, int, Uint8*);
+void   stopDataset();
+int    dropPiece(Uint8*, const Uint8*, int, int*, int*);
+long   simulateGames(int);
 
 ///////////////////////////////////////////////////////////////////////////////
 // Global Variables
@@ -106,6 +357,60 @@ int COLOR_ORANGE[3] = {0xFF, 0xA5, 0x00};
 int COLOR_YELLOW[3] = {0xFF, 0xFF, 0x00};
 int COLOR_PURPLE[3] = {0xFF, 0x00, 0xFF};
 
+// Colors that get a pre-rendered tile, in atlas order
+int* tileColors[NUM_TILES] = {
+  COLOR_RED, COLOR_GREEN, COLOR_BLUE, COLOR_ORANGE, COLOR_YELLOW, COLOR_PURPLE
+};
+
+// Characters of the built in font and their 5x7 bitmaps, one byte per row
+// with the leftmost pixel in bit 4. Anything else renders as a space.
+const char* FONT_CHARS = " 0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ:.-!/";
+
+const Uint8 FONT[][FONT_HEIGHT] = {
+  {0x00,0x00,0x00,0x00,0x00,0x00,0x00}, // ' '
+  {0x0E,0x11,0x13,0x15,0x19,0x11,0x0E}, // 0
+  {0x04,0x0C,0x04,0x04,0x04,0x04,0x0E}, // 1
+  {0x0E,0x11,0x01,0x02,0x04,0x08,0x1F}, // 2
+  {0x1F,0x02,0x04,0x02,0x01,0x11,0x0E}, // 3
+  {0x02,0x06,0x0A,0x12,0x1F,0x02,0x02}, // 4
+  {0x1F,0x10,0x1E,0x01,0x01,0x11,0x0E}, // 5
+  {0x06,0x08,0x10,0x1E,0x11,0x11,0x0E}, // 6
+  {0x1F,0x01,0x02,0x04,0x08,0x08,0x08}, // 7
+  {0x0E,0x11,0x11,0x0E,0x11,0x11,0x0E}, // 8
+  {0x0E,0x11,0x11,0x0F,0x01,0x02,0x0C}, // 9
+  {0x0E,0x11,0x11,0x11,0x1F,0x11,0x11}, // A
+  {0x1E,0x11,0x11,0x1E,0x11,0x11,0x1E}, // B
+  {0x0E,0x11,0x10,0x10,0x10,0x11,0x0E}, // C
+  {0x1C,0x12,0x11,0x11,0x11,0x12,0x1C}, // D
+  {0x1F,0x10,0x10,0x1E,0x10,0x10,0x1F}, // E
+  {0x1F,0x10,0x10,0x1E,0x10,0x10,0x10}, // F
+  {0x0E,0x11,0x10,0x17,0x11,0x11,0x0F}, // G
+  {0x11,0x11,0x11,0x1F,0x11,0x11,0x11}, // H
+  {0x0E,0x04,0x04,0x04,0x04,0x04,0x0E}, // I
+  {0x07,0x02,0x02,0x02,0x02,0x12,0x0C}, // J
+  {0x11,0x12,0x14,0x18,0x14,0x12,0x11}, // K
+  {0x10,0x10,0x10,0x10,0x10,0x10,0x1F}, // L
+  {0x11,0x1B,0x15,0x15,0x11,0x11,0x11}, // M
+  {0x11,0x11,0x19,0x15,0x13,0x11,0x11}, // N
+  {0x0E,0x11,0x11,0x11,0x11,0x11,0x0E}, // O
+  {0x1E,0x11,0x11,0x1E,0x10,0x10,0x10}, // P
+  {0x0E,0x11,0x11,0x11,0x15,0x12,0x0D}, // Q
+  {0x1E,0x11,0x11,0x1E,0x14,0x12,0x11}, // R
+  {0x0F,0x10,0x10,0x0E,0x01,0x01,0x1E}, // S
+  {0x1F,0x04,0x04,0x04,0x04,0x04,0x04}, // T
+  {0x11,0x11,0x11,0x11,0x11,0x11,0x0E}, // U
+  {0x11,0x11,0x11,0x11,0x11,0x0A,0x04}, // V
+  {0x11,0x11,0x11,0x15,0x15,0x15,0x0A}, // W
+  {0x11,0x11,0x0A,0x04,0x0A,0x11,0x11}, // X
+  {0x11,0x11,0x11,0x0A,0x04,0x04,0x04}, // Y
+  {0x1F,0x01,0x02,0x04,0x08,0x10,0x1F}, // Z
+  {0x00,0x0C,0x0C,0x00,0x0C,0x0C,0x00}, // :
+  {0x00,0x00,0x00,0x00,0x00,0x0C,0x0C}, // .
+  {0x00,0x00,0x00,0x1F,0x00,0x00,0x00}, // -
+  {0x04,0x04,0x04,0x04,0x04,0x00,0x04}, // !
+  {0x00,0x01,0x02,0x04,0x08,0x10,0x00}, // /
+};
+
 // Block compacting interval
 double blockCompactingInterval = .012;
 
@@ -118,11 +423,12 @@ double columnDownInterval = .1;
 
 // An array of blocks representing the column
 Block  columnBlocks[BLOCK_COLUMN_LENGTH];
-double lastColumnDownMove = 0.0;
+
+// Times the column's colors have been cycled since it spawned
+int columnRotation = 0;
 
 // A matrix of blocks representing the blocks that have been placed
 Block placedBlocks[GRID_BLOCK_WIDTH][GRID_BLOCK_HEIGHT];
-double lastCompactBlocksMove = 0.0;
 
 // An array of 
 int occupiedSlots[GRID_BLOCK_WIDTH];
@@ -130,10 +436,47 @@ int occupiedSlots[GRID_BLOCK_WIDTH];
 // Are we still playing the game?
 int gameOver = 0;
 
+// Specialized board kernels for our shape, NULL to use the generic ones
+BoardKernel* boardKernel = NULL;
+
+// Blocks cleared so far
+int score = 0;
+
+// Frames drawn in total and per second over the last second
+long framesDrawn     = 0;
+long lastFramesDrawn = 0;
+int  framesPerSecond = 0;
+
+// Everything that happens on a schedule
+TimerWheel timers;
+
+// Gameplay recording, inactive while capture.out is NULL
+FrameCapture capture;
+
+// Placement export, inactive while dataset.out is NULL
+DatasetWriter dataset;
+
+// Everything is drawn at GRID_WIDTH x GRID_HEIGHT into the backbuffer, which
+// is then scaled to the window
+SDL_Surface* backbuffer;
+ScaleTables  scaleTables;
+
+// One shaded BLOCK_WIDTH x BLOCK_HEIGHT tile per tile color, side by side,
+// in the display format
+SDL_Surface* tileAtlas;
+
+// Score, frame rate and game over text
+Hud hud;
+
+// Bursts from cleared blocks
+Particles particles;
+
 ///////////////////////////////////////////////////////////////////////////////
 // Main Game Loop
 ///////////////////////////////////////////////////////////////////////////////
 
+// Tools like fuzz/board_fuzz.c include this file and bring their own main
+#ifndef BLOCKS_NO_MAIN
 int main(int argc, char* argv[]) {
 
   initGameState();
@@ -144,22 +487,87 @@ int main(int argc, char* argv[]) {
   int keypress = 0;
   int h        = 0; 
 
+  // Command line options
+  const char* capturePath = NULL;
+  int         captureRgba = false;
+  const char* recordPath  = NULL;
+  int         simulate    = 0;
+
+  int a;
+  for(a=1; a < argc; a++) {
+    if(strcmp(argv[a], "-capture") == 0 && a+1 < argc) {
+      capturePath = argv[++a];
+    } else if(strcmp(argv[a], "-rgba") == 0) {
+      captureRgba = true;
+    } else if(strcmp(argv[a], "-record") == 0 && a+1 < argc) {
+      recordPath = argv[++a];
+    } else if(strcmp(argv[a], "-simulate") == 0 && a+1 < argc) {
+      simulate = atoi(argv[++a]);
+    } else if(strcmp(argv[a], "-seed") == 0 && a+1 < argc) {
+      srand(atoi(argv[++a]));
+    }
+  }
+
+  // Headless games, no window and no timers
+  if(simulate > 0) {
+    if(recordPath && !startDataset(recordPath)) {
+      fprintf(stderr, "Could not start recording to %s\n", recordPath);
+      return 1;
+    }
+
+    double start      = hires_time_in_seconds();
+    long   placements = simulateGames(simulate);
+    double elapsed    = hires_time_in_seconds() - start;
+
+    stopDataset();
+
+    fprintf(stderr, "Simulated %d games, %ld placements in %.3fs (%.0f/s)\n",
+            simulate, placements, elapsed, placements / (elapsed > 0 ? elapsed : 1));
+    return 0;
+  }
+
   if (SDL_Init(SDL_INIT_VIDEO) < 0 ) return 1;
 
-  if (!(screen = SDL_SetVideoMode(GRID_WIDTH, GRID_HEIGHT, DEPTH, 
-                                  SDL_RESIZABLE|SDL_HWSURFACE))) {
+  if (!(screen = SDL_SetVideoMode(GRID_WIDTH, GRID_HEIGHT, DEPTH, VIDEO_FLAGS))) {
     SDL_Quit();
     return 1;
   }
 
   SDL_WM_SetCaption(title, title);
 
+  backbuffer = SDL_CreateRGBSurface(SDL_SWSURFACE, GRID_WIDTH, GRID_HEIGHT, DEPTH,
+                                    screen->format->Rmask, screen->format->Gmask,
+                                    screen->format->Bmask, screen->format->Amask);
+  if(!backbuffer) {
+    SDL_Quit();
+    return 1;
+  }
+
+  buildScaleTables(screen);
+  buildTileAtlas();
+  buildHud();
+
+  if(capturePath && !startCapture(capturePath, captureRgba, backbuffer)) {
+    fprintf(stderr, "Could not start capturing to %s\n", capturePath);
+  }
+
+  if(recordPath && !startDataset(recordPath)) {
+    fprintf(stderr, "Could not start recording to %s\n", recordPath);
+  }
+
   // Initial column spawn
   spawnColumn();
   
   double currentTime = hires_time_in_seconds();
   double FPS_dt      = (double)1/FPS;
 
+  initTimers(currentTime);
+  addTimer(columnDownInterval,      columnDownInterval,      moveColumnDown);
+  addTimer(blockCompactingInterval, blockCompactingInterval, compactBlocks);
+  addTimer(0,                       FPS_dt,                  updateParticles);
+  addTimer(0,                       FPS_dt,                  renderFrame);
+  addTimer(1,                       1,                       countFrames);
+
   int gameOn = 1;
 
   while(gameOn) {
@@ -169,6 +577,24 @@ int main(int argc, char* argv[]) {
       if(event.type == SDL_QUIT) {
         gameOn = 0;
         break;
+      } else if(event.type == SDL_VIDEORESIZE) {
+        SDL_Surface* resized = SDL_SetVideoMode(event.resize.w, event.resize.h, DEPTH, VIDEO_FLAGS);
+
+        // A size the display can't do keeps the window as it was
+        if(!resized) {
+          fprintf(stderr, "Could not resize to %dx%d, staying at %dx%d\n",
+                  event.resize.w, event.resize.h, scaleTables.w, scaleTables.h);
+          resized = SDL_SetVideoMode(scaleTables.w, scaleTables.h, DEPTH, VIDEO_FLAGS);
+          scaleTables.clearBorders = 2;
+        }
+
+        // Without any mode there is nothing left to draw on
+        if(!(screen = resized)) {
+          gameOn = 0;
+          break;
+        }
+        buildScaleTables(screen);
+        buildTileAtlas();
       } else if(event.type == SDL_KEYDOWN) {
         switch(event.key.keysym.sym) {  
           case SDLK_LEFT:
@@ -190,27 +616,32 @@ int main(int argc, char* argv[]) {
       }
     }    
 
-    // Calculations
-    moveColumnDown(currentTime);
-    compactBlocks(currentTime);
+    // Calculations and rendering, whatever is due
+    currentTime = hires_time_in_seconds();
+    runTimers(currentTime);
 
-    // Keep a constant framerate
-    double newTime = hires_time_in_seconds();
-    while(newTime - currentTime < FPS_dt) {
-      SDL_Delay(20);
-      newTime = hires_time_in_seconds();          
-    } 
+    // Sleep until the next timer is due
+    double wait = nextTimerDeadline() - hires_time_in_seconds();
+    if(wait > 0) {
+      SDL_Delay((Uint32)ceil(wait * 1000));
+    }
+  }
 
-    currentTime = newTime;
+  stopCapture();
+  stopDataset();
 
-    // Render the screen
-    DrawScreen(screen);
-  }
+  freeHud();
+  SDL_FreeSurface(tileAtlas);
+  SDL_FreeSurface(backbuffer);
+  free(scaleTables.colMap);
+  free(scaleTables.rowMap);
+  free(scaleTables.row);
 
   SDL_Quit();
   
   return 0;
 }
+#endif
 
 ///////////////////////////////////////////////////////////////////////////////
 // Functions
@@ -243,6 +674,8 @@ void initGameState() {
   for(x=0; x < GRID_BLOCK_WIDTH; x++) {
     occupiedSlots[x] = GRID_BLOCK_HEIGHT;
   }
+
+  boardKernel = selectBoardKernel(GRID_BLOCK_WIDTH, GRID_BLOCK_HEIGHT, BLOCKS_TO_MATCH);
 }
 
 void spawnColumn() {
@@ -255,6 +688,8 @@ void spawnColumn() {
     columnBlocks[c].y        = (c-2)*BLOCK_HEIGHT;
     columnBlocks[c].color    = getRandomColor();
   }
+
+  columnRotation = 0;
 }
 
 int* getRandomColor() {
@@ -282,7 +717,74 @@ void drawRect(SDL_Surface *screen, int x, int y, int w, int h, int *rgb) {
 }
 
 void renderBlock(SDL_Surface *screen, Block block) {
-  drawRect(screen, block.x, block.y, BLOCK_WIDTH, BLOCK_HEIGHT, block.color);
+  int tile = tileIndex(block.color);
+
+  if(!tileAtlas || tile < 0) {
+    drawRect(screen, block.x, block.y, BLOCK_WIDTH, BLOCK_HEIGHT, block.color);
+    return;
+  }
+
+  SDL_Rect src = {tile * BLOCK_WIDTH, 0, BLOCK_WIDTH, BLOCK_HEIGHT};
+  SDL_Rect dst = {block.x, block.y, BLOCK_WIDTH, BLOCK_HEIGHT};
+  SDL_BlitSurface(tileAtlas, &src, screen, &dst);
+}
+
+/** Position of a color in the tile atlas, -1 if it has no tile */
+int tileIndex(int *color) {
+  int i;
+  for(i=0; i < NUM_TILES; i++) {
+    if(tileColors[i] == color) return i;
+  }
+  return -1;
+}
+
+/** Lighten a color channel towards white (percent > 0) or darken it towards
+black (percent < 0) */
+Uint8 shadeChannel(int c, int percent) {
+  if(percent > 0) return c + (255 - c) * percent / 100;
+  return c * (100 + percent) / 100;
+}
+
+/** Render the beveled tiles once and convert them to the display format.
+Needs to run again whenever the video mode changes. */
+void buildTileAtlas() {
+  SDL_Surface* tiles = SDL_CreateRGBSurface(SDL_SWSURFACE, NUM_TILES * BLOCK_WIDTH,
+                                            BLOCK_HEIGHT, DEPTH, 0x00FF0000, 0x0000FF00,
+                                            0x000000FF, 0);
+  if(!tiles) return;
+
+  int t, x, y;
+  for(t=0; t < NUM_TILES; t++) {
+    int* rgb = tileColors[t];
+
+    for(y=0; y < BLOCK_HEIGHT; y++) {
+      Uint32* row = (Uint32 *)((Uint8 *)tiles->pixels + y * tiles->pitch) + t * BLOCK_WIDTH;
+
+      for(x=0; x < BLOCK_WIDTH; x++) {
+        // The bevel edge is whichever side is closest, which mitres the
+        // corners. The face gets a soft top to bottom gradient.
+        int top    = y;
+        int left   = x;
+        int bottom = BLOCK_HEIGHT - 1 - y;
+        int right  = BLOCK_WIDTH - 1 - x;
+        int nearest = min(min(top, left), min(bottom, right));
+        int percent;
+
+        if(nearest >= TILE_BEVEL)  percent = 15 - 30 * y / BLOCK_HEIGHT;
+        else if(nearest == top)    percent = 55;
+        else if(nearest == left)   percent = 30;
+        else if(nearest == right)  percent = -30;
+        else                       percent = -50;
+
+        row[x] = SDL_MapRGB(tiles->format, shadeChannel(rgb[0], percent),
+                            shadeChannel(rgb[1], percent), shadeChannel(rgb[2], percent));
+      }
+    }
+  }
+
+  if(tileAtlas) SDL_FreeSurface(tileAtlas);
+  tileAtlas = SDL_DisplayFormat(tiles);
+  SDL_FreeSurface(tiles);
 }
 
 void renderColumn(SDL_Surface *screen) {
@@ -306,24 +808,168 @@ void renderPlacedBlocks(SDL_Surface *screen) {
 }
 
 void DrawScreen(SDL_Surface* screen) { 
-  if(SDL_MUSTLOCK(screen)) {
-    if(SDL_LockSurface(screen) < 0) return;
-  }
-
   // Render Background
-  drawRect(screen, 0, 0, GRID_WIDTH, GRID_HEIGHT, COLOR_BLACK);
+  drawRect(backbuffer, 0, 0, GRID_WIDTH, GRID_HEIGHT, COLOR_BLACK);
 
   // Render Column
-  renderColumn(screen);
+  renderColumn(backbuffer);
 
   // Render Placed Blocks
-  renderPlacedBlocks(screen);
+  renderPlacedBlocks(backbuffer);
+
+  // Render Particles
+  drawParticles(backbuffer);
+
+  // Render the HUD on top
+  updateHud();
+  drawHud(backbuffer);
+
+  // Record the finished frame
+  captureFrame(backbuffer);
+
+  // Letterbox borders only need clearing after a resize
+  if(scaleTables.clearBorders > 0) {
+    drawRect(screen, 0, 0, screen->w, screen->h, COLOR_BLACK);
+    scaleTables.clearBorders--;
+  }
+
+  if(SDL_MUSTLOCK(screen)) {
+    if(SDL_LockSurface(screen) < 0) return;
+  }
+
+  presentBackbuffer(screen);
 
   if(SDL_MUSTLOCK(screen)) SDL_UnlockSurface(screen);
 
   SDL_Flip(screen); 
 }
 
+/** Work out where the board goes in the window and fill in the row and
+column maps. Scales up by the largest integer factor that fits, windows
+smaller than the board get a nearest neighbor shrink instead. */
+void buildScaleTables(SDL_Surface* screen) {
+  if(scaleTables.colMap && scaleTables.w == screen->w && scaleTables.h == screen->h) return;
+
+  scaleTables.w     = screen->w;
+  scaleTables.h     = screen->h;
+  scaleTables.scale = (int)min(screen->w / GRID_WIDTH, screen->h / GRID_HEIGHT);
+
+  int dstW, dstH;
+  if(scaleTables.scale >= 1) {
+    dstW = GRID_WIDTH  * scaleTables.scale;
+    dstH = GRID_HEIGHT * scaleTables.scale;
+  } else if(screen->w * GRID_HEIGHT < screen->h * GRID_WIDTH) {
+    dstW = screen->w;
+    dstH = screen->w * GRID_HEIGHT / GRID_WIDTH;
+  } else {
+    dstW = screen->h * GRID_WIDTH / GRID_HEIGHT;
+    dstH = screen->h;
+  }
+  if(dstW < 1) dstW = 1;
+  if(dstH < 1) dstH = 1;
+
+  scaleTables.dst.x = (screen->w - dstW) / 2;
+  scaleTables.dst.y = (screen->h - dstH) / 2;
+  scaleTables.dst.w = dstW;
+  scaleTables.dst.h = dstH;
+
+  scaleTables.colMap = (int *)realloc(scaleTables.colMap, dstW * sizeof(int));
+  scaleTables.rowMap = (int *)realloc(scaleTables.rowMap, dstH * sizeof(int));
+  scaleTables.row    = (Uint32 *)realloc(scaleTables.row, dstW * sizeof(Uint32));
+
+  int i;
+  for(i=0; i < dstW; i++) scaleTables.colMap[i] = i * GRID_WIDTH / dstW;
+  for(i=0; i < dstH; i++) scaleTables.rowMap[i] = i * GRID_HEIGHT / dstH;
+
+  // Once per buffer in case the mode is double buffered
+  scaleTables.clearBorders = 2;
+}
+
+/** Write every source pixel scale times in a row */
+void replicateRow(Uint32* dst, const Uint32* src, int n, int scale) {
+  int i = 0;
+  int j;
+
+  if(scale == 1) {
+    memcpy(dst, src, n * sizeof(Uint32));
+    return;
+  }
+
+#if defined(__SSE2__) || defined(__ARM_NEON)
+  if(scale == 2) {
+    for(; i+4 <= n; i += 4) {
+#if defined(__SSE2__)
+      __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+      _mm_storeu_si128((__m128i *)(dst + 2*i),     _mm_unpacklo_epi32(v, v));
+      _mm_storeu_si128((__m128i *)(dst + 2*i + 4), _mm_unpackhi_epi32(v, v));
+#else
+      uint32x4_t   v = vld1q_u32(src + i);
+      uint32x4x2_t z = vzipq_u32(v, v);
+      vst1q_u32(dst + 2*i,     z.val[0]);
+      vst1q_u32(dst + 2*i + 4, z.val[1]);
+#endif
+    }
+  } else {
+    // Four pixel stores may run into the next pixel's run, which is written
+    // afterwards. The last pixel is left to the scalar loop so we never
+    // write past the end of the row.
+    for(; i < n-1; i++) {
+#if defined(__SSE2__)
+      __m128i v = _mm_set1_epi32((int)src[i]);
+      for(j=0; j < scale; j += 4) _mm_storeu_si128((__m128i *)(dst + i*scale + j), v);
+#else
+      uint32x4_t v = vdupq_n_u32(src[i]);
+      for(j=0; j < scale; j += 4) vst1q_u32(dst + i*scale + j, v);
+#endif
+    }
+  }
+#endif
+
+  for(; i < n; i++) {
+    for(j=0; j < scale; j++) dst[i*scale + j] = src[i];
+  }
+}
+
+/** Copy the backbuffer into the (locked) screen using the scale tables.
+Each backbuffer row is scaled once into a system memory row and copied to
+every window row it covers, so the screen is only written, never read back
+(it may be a hardware surface). */
+void presentBackbuffer(SDL_Surface* screen) {
+  Uint8*  pixels = (Uint8 *)screen->pixels;
+  Uint32* row    = scaleTables.row;
+  int     dstW   = scaleTables.dst.w;
+  int     dy, dx;
+
+  for(dy=0; dy < scaleTables.dst.h; dy++) {
+    Uint32* out = (Uint32 *)(pixels + (scaleTables.dst.y + dy) * screen->pitch) + scaleTables.dst.x;
+    int     sy  = scaleTables.rowMap[dy];
+
+    if(dy == 0 || sy != scaleTables.rowMap[dy-1]) {
+      const Uint32* src = (const Uint32 *)((Uint8 *)backbuffer->pixels + sy * backbuffer->pitch);
+      if(scaleTables.scale >= 1) {
+        replicateRow(row, src, GRID_WIDTH, scaleTables.scale);
+      } else {
+        for(dx=0; dx < dstW; dx++) row[dx] = src[scaleTables.colMap[dx]];
+      }
+    }
+
+    memcpy(out, row, dstW * sizeof(Uint32));
+  }
+}
+
+/** Frame timer callback. Draws to whatever the current video surface is so
+it keeps working across resizes. */
+void renderFrame(double currentTime) {
+  DrawScreen(SDL_GetVideoSurface());
+  framesDrawn++;
+}
+
+/** Once a second, work out the frame rate for the HUD */
+void countFrames(double currentTime) {
+  framesPerSecond = (int)(framesDrawn - lastFramesDrawn);
+  lastFramesDrawn = framesDrawn;
+}
+
 /** Returnt the current time in seconds */
 double hires_time_in_seconds() {
   struct timeval tv;
@@ -337,20 +983,10 @@ float min(double a, double b) {
 
 /** Slide blocks with un-occupied slots underneath them down. This should
 compact the grid of blocks. Note: We need to clear and score after each
-cycle. */
+cycle. Runs every block compacting interval off the timer wheel. */
 void compactBlocks(double currentTime) {
   if(gameOver == 1) return;
 
-  if(lastCompactBlocksMove <= 0) {
-    lastCompactBlocksMove = currentTime;
-  }
-
-  if(currentTime - lastCompactBlocksMove < blockCompactingInterval) {
-    return;
-  }
-
-  lastCompactBlocksMove = currentTime;
-
   int amnt       = ceil(BLOCK_HEIGHT/2);
   int lowerBound = GRID_HEIGHT - BLOCK_HEIGHT;
 
@@ -401,8 +1037,10 @@ void compactBlocks(double currentTime) {
     }
   }
 
-  // Reset the occupied slot values
+  // Reset the occupied slot values. Columns emptied by a clear go back to
+  // the same value initGameState uses.
   for(x=0; x < GRID_BLOCK_WIDTH; x++) {
+    occupiedSlots[x] = GRID_BLOCK_HEIGHT;
     for(y=0; y < GRID_BLOCK_HEIGHT; y++) {
       if(placedBlocks[x][y].occupied) {
         occupiedSlots[x] = y-1;
@@ -412,22 +1050,11 @@ void compactBlocks(double currentTime) {
   }
 }
 
-/** Move the column down the grid. Take the current game time to
-make sure we don't move the column down too often. Note: the
-column down interval determines how often we move the column down. */
+/** Move the column down the grid one step. Runs off the timer wheel, 
+the column down interval determines how often we move the column down. */
 void moveColumnDown(double currentTime) {
   if(gameOver == 1) return;
 
-  if(lastColumnDownMove <= 0) {
-    lastColumnDownMove = currentTime;
-  }
-
-  if(currentTime - lastColumnDownMove < columnDownInterval) {
-    return;
-  }
-
-  lastColumnDownMove = currentTime;
-
   int amnt       = ceil(BLOCK_HEIGHT/2);
   int lowerBound = GRID_HEIGHT - BLOCK_HEIGHT;
   int maxY       = columnBlocks[BLOCK_COLUMN_LENGTH-1].y + amnt;
@@ -445,10 +1072,18 @@ void moveColumnDown(double currentTime) {
   // and the gridX's for blocks
   if(maxY > lowerBound || nextGridY >= maxGridY) {
     // We've hit the bottom of the board
+    // Keep the board as it was before the drop for the dataset
+    Uint8 before[GRID_BLOCK_WIDTH * GRID_BLOCK_HEIGHT];
+    int   scoreBefore = score;
+    if(dataset.out) boardCells(before);
+
     // Shift the blockColumn into the placedBlocks array
     int c;
     for(c=0; c < BLOCK_COLUMN_LENGTH; c++) {
 
+      // Blocks still above the grid have no slot to land in
+      if(columnBlocks[c].y < 0) continue;
+
       int oldGridY = columnBlocks[c].y / BLOCK_HEIGHT;
 
       // Align the block's position with the grid
@@ -471,7 +1106,10 @@ void moveColumnDown(double currentTime) {
     clearAndScore();
     
     // Make sure we haven't hit the top of the grid i.e. "GAME OVER"
-    if(nextGridY - BLOCK_COLUMN_LENGTH <= 0) {
+    int ended = nextGridY - BLOCK_COLUMN_LENGTH <= 0;
+    recordLanding(before, gridX, score - scoreBefore, ended);
+
+    if(ended) {
       gameOver = true;
       return;
     }
@@ -497,11 +1135,10 @@ void moveColumnRight() {
     int nx       = columnBlocks[c].x + BLOCK_WIDTH;
     int nGridX   = (nx/BLOCK_WIDTH);
     int gridY    = ceil((columnBlocks[BLOCK_COLUMN_LENGTH-1].y)/BLOCK_HEIGHT)-1;
-    int maxGridY = occupiedSlots[nGridX];
 
     if(nx > GRID_WIDTH-BLOCK_WIDTH) {
       nx = GRID_WIDTH-BLOCK_WIDTH;
-    } else if(gridY >= maxGridY) {
+    } else if(gridY >= occupiedSlots[nGridX]) {
       continue;
     }
 
@@ -519,11 +1156,10 @@ void moveColumnLeft() {
     int nx       = columnBlocks[c].x - BLOCK_WIDTH;
     int nGridX   = (nx/BLOCK_WIDTH);
     int gridY    = ceil((columnBlocks[BLOCK_COLUMN_LENGTH-1].y)/BLOCK_HEIGHT)-1;
-    int maxGridY = occupiedSlots[nGridX];    
 
     if(nx < 0) {
       nx = 0;
-    } else if(gridY >= maxGridY) {
+    } else if(gridY >= occupiedSlots[nGridX]) {
       continue;
     }
 
@@ -540,312 +1176,969 @@ void shiftColumnColors() {
   columnBlocks[0].color = color2;
   columnBlocks[1].color = color0;
   columnBlocks[2].color = color1;
+
+  columnRotation = (columnRotation + 1) % BLOCK_COLUMN_LENGTH;
 }
 
 void clearAndScore() {
-  // When a block moves from the blockColumn to the placedBlocks array 
-  // then we need to check each of it's blocks for >= <BLOCKS_TO_MATCH> block matches
-  int foundBlocksToRemove = false;
+  // Check the whole grid for lines of >= <BLOCKS_TO_MATCH> blocks. Matches
+  // are marked first and cleared afterwards so that a block shared by two
+  // lines (e.g. a cross) counts towards both of them.
+  Uint8  cells[GRID_BLOCK_WIDTH * GRID_BLOCK_HEIGHT];
+  Uint32 blocksToClear[GRID_BLOCK_WIDTH];
+
+  boardCells(cells);
+  findMatches(cells, blocksToClear);
 
-  // Loop through the blocks that have just landed
-  int bc;
   int x,y;
-  //for(bc=0; bc < BLOCK_COLUMN_LENGTH; bc++) {
 
   for(x=0; x < GRID_BLOCK_WIDTH; x++) {
     for(y=0; y < GRID_BLOCK_HEIGHT; y++) {
+      if(blocksToClear[x] & (1u << y)) {
+        spawnParticles(x * BLOCK_WIDTH + BLOCK_WIDTH/2, y * BLOCK_HEIGHT + BLOCK_HEIGHT/2,
+                       placedBlocks[x][y].color);
+        placedBlocks[x][y].occupied = false;
+        placedBlocks[x][y].color    = COLOR_BLACK;
+        score++;
+      }
+    }
+  }
+}
 
-      Block block = placedBlocks[x][y]; //columnBlocks[bc];
+/** The placed blocks as color ids for the board kernels */
+void boardCells(Uint8* cells) {
+  int x,y;
+  for(x=0; x < GRID_BLOCK_WIDTH; x++) {
+    for(y=0; y < GRID_BLOCK_HEIGHT; y++) {
+      cells[x*GRID_BLOCK_HEIGHT + y] = placedBlocks[x][y].occupied
+                                     ? cellColor(placedBlocks[x][y].color) : 0;
+    }
+  }
+}
 
-      if(!block.occupied) continue;
-    
-      int gridX = block.x / BLOCK_WIDTH;
-      int gridY = block.y / BLOCK_HEIGHT;
-
-      // Initialize linked lists for tracking matching blocks
-      BlockRemItem hBlocksToRemove;
-      hBlocksToRemove.x    = -1;
-      hBlocksToRemove.y    = -1;
-      hBlocksToRemove.next = NULL;    
-
-      BlockRemItem vBlocksToRemove;
-      vBlocksToRemove.x    = -1;
-      vBlocksToRemove.y    = -1;
-      vBlocksToRemove.next = NULL;        
-
-      BlockRemItem fdBlocksToRemove;
-      fdBlocksToRemove.x    = -1;
-      fdBlocksToRemove.y    = -1;
-      fdBlocksToRemove.next = NULL;        
-
-      BlockRemItem bdBlocksToRemove;
-      bdBlocksToRemove.x    = -1;
-      bdBlocksToRemove.y    = -1;
-      bdBlocksToRemove.next = NULL;     
-
-      // Temp pointer to be used for allocating new temp blocks to remove below
-      BlockRemItem* tItem;
-
-      // Horizontal
-      int hrGridX = gridX;
-      int hlGridX = gridX;
-
-      // Vertical
-      int vuGridY = gridY;
-      int vdGridY = gridY;
-
-      // Forward Diagonal
-      int fdGridX = gridX;
-      int fdGridY = gridY;
-      int fuGridX = gridX;
-      int fuGridY = gridY;
-  
-      // Backward Diagonal  
-      int bdGridX = gridX;
-      int bdGridY = gridY;
-      int buGridX = gridX;
-      int buGridY = gridY;
-
-      int blValid = true;
-      int urValid = true;
-      int lrValid = true;
-      int ulValid = true;
-
-      int hrValid = true;
-      int hlValid = true;
-      int vuValid = true;
-      int vdValid = true;
-    
-      while(blValid || urValid || lrValid || ulValid || hrValid || hlValid || vuValid || vdValid) {
+/** Color id of a block for the board kernels, never 0 */
+Uint8 cellColor(int *color) {
+  int tile = tileIndex(color);
+  return tile < 0 ? MAX_CELL_COLOR : tile + 1;
+}
 
-        // Moving to the bottom left
-        fdGridX--;
-        fdGridY++;
-        blValid = blValid && fdGridX >= 0 && fdGridY < GRID_BLOCK_HEIGHT;
-    
-        if(blValid) {
-          Block tBlock = placedBlocks[fdGridX][fdGridY];
-          if(tBlock.occupied && tBlock.color == block.color) {
-            tItem = (BlockRemItem *)malloc(sizeof(BlockRemItem));       
-            tItem->x = tBlock.x;
-            tItem->y = tBlock.y;
-            tItem->next = NULL;          
-          
-            addItemToRemList(&fdBlocksToRemove, tItem);
-          } else {
-            blValid = false;
-          }
-        }
-    
-        // Moving to the upper right
-        fuGridX++;
-        fuGridY--;
-        urValid = urValid && fuGridX < GRID_BLOCK_WIDTH && fuGridY >= 0;
-    
-        if(urValid) {
-          Block tBlock = placedBlocks[fuGridX][fuGridY];
-          if(tBlock.occupied && tBlock.color == block.color) {
-            tItem = (BlockRemItem *)malloc(sizeof(BlockRemItem));       
-            tItem->x = tBlock.x;
-            tItem->y = tBlock.y;
-            tItem->next = NULL;          
-          
-            addItemToRemList(&fdBlocksToRemove, tItem);   
-          } else {
-            urValid = false;
-          }
-        }    
-    
-        // Moving to the lower right
-        bdGridX++;
-        bdGridY++;
-        lrValid = lrValid && bdGridX < GRID_BLOCK_WIDTH && bdGridY < GRID_BLOCK_HEIGHT;
-
-        if(lrValid) {
-          Block tBlock = placedBlocks[bdGridX][bdGridY];
-          if(tBlock.occupied && tBlock.color == block.color) {
-            tItem = (BlockRemItem *)malloc(sizeof(BlockRemItem));       
-            tItem->x = tBlock.x;
-            tItem->y = tBlock.y;
-            tItem->next = NULL;          
-          
-            addItemToRemList(&bdBlocksToRemove, tItem);
-          } else {
-            lrValid = false;
-          }
-        }    
-    
-        // Moving to the upper left
-        buGridX--;
-        buGridY--;
-        ulValid = ulValid && buGridX >= 0 && buGridY >= 0;
-    
-        if(ulValid) {
-          Block tBlock = placedBlocks[buGridX][buGridY];
-          if(tBlock.occupied && tBlock.color == block.color) {
-            tItem = (BlockRemItem *)malloc(sizeof(BlockRemItem));       
-            tItem->x = tBlock.x;
-            tItem->y = tBlock.y;
-            tItem->next = NULL;          
-          
-            addItemToRemList(&bdBlocksToRemove, tItem);
-          } else {
-            ulValid = false;
-          }
-        }
+/** Find matches on a board of the game's shape with the best kernel */
+void findMatches(const Uint8* cells, Uint32* marks) {
+  if(boardKernel) boardKernel->findMatches(cells, marks);
+  else            findMatchesGeneric(cells, marks, GRID_BLOCK_WIDTH, GRID_BLOCK_HEIGHT, BLOCKS_TO_MATCH);
+}
 
-        // Move to the horizonal right
-        hrGridX++;
-        hrValid = hrValid && hrGridX < GRID_BLOCK_WIDTH;
-    
-        if(hrValid) {
-          Block tBlock = placedBlocks[hrGridX][gridY];
-          if(tBlock.occupied && tBlock.color == block.color) {
-            tItem = (BlockRemItem *)malloc(sizeof(BlockRemItem));       
-            tItem->x = tBlock.x;
-            tItem->y = tBlock.y;
-            tItem->next = NULL;              
-
-            addItemToRemList(&hBlocksToRemove, tItem);
-          } else {
-            hrValid = false;
-          }
+/** Settle a board of the game's shape with the best kernel */
+int settleCells(Uint8* cells) {
+  if(boardKernel) return boardKernel->settle(cells);
+  return settleGeneric(cells, GRID_BLOCK_WIDTH, GRID_BLOCK_HEIGHT);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Frame Capture
+///////////////////////////////////////////////////////////////////////////////
+
+/** Start recording frames of the given screen. The path is a file, "-" for
+stdout or "|command" to pipe into e.g. an encoder. Frames are written as Y4M
+unless rgba is set. Returns false if capturing could not be started. */
+int startCapture(const char* path, int rgba, SDL_Surface* screen) {
+  if(screen->format->BytesPerPixel != 4) return false;
+
+  memset(&capture, 0, sizeof(capture));
+  capture.rgba     = rgba;
+  capture.w        = screen->w;
+  capture.h        = screen->h;
+  capture.rowBytes = screen->w * 4;
+  capture.format   = *screen->format;
+
+  if(strcmp(path, "-") == 0) {
+    capture.out = stdout;
+  } else if(path[0] == '|') {
+    // An encoder that exits must not take the game down with SIGPIPE. The
+    // write fails with EPIPE instead and the frames count as dropped.
+    signal(SIGPIPE, SIG_IGN);
+    capture.out    = popen(path+1, "w");
+    capture.isPipe = true;
+  } else {
+    capture.out = fopen(path, "wb");
+  }
+
+  if(!capture.out) return false;
+
+  // All memory is allocated up front and recycled for every frame
+  int i;
+  for(i=0; i < CAPTURE_POOL_SIZE; i++) {
+    capture.frames[i]     = (Uint8 *)malloc(capture.rowBytes * capture.h);
+    capture.freeFrames[i] = i;
+  }
+  capture.freeCount = CAPTURE_POOL_SIZE;
+  capture.scratch   = (Uint8 *)malloc(capture.rowBytes * capture.h);
+
+  if(!rgba) {
+    fprintf(capture.out, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444 XCOLORRANGE=FULL\n",
+            capture.w, capture.h, FPS);
+  }
+
+  capture.lock   = SDL_CreateMutex();
+  capture.ready  = SDL_CreateCond();
+  capture.thread = SDL_CreateThread(captureWriter, NULL);
+
+  return true;
+}
+
+/** Copy the (locked) screen into a free pool buffer and queue it for the
+writer. When the writer has fallen behind the frame is dropped. */
+void captureFrame(SDL_Surface* screen) {
+  if(!capture.out) return;
+
+  SDL_LockMutex(capture.lock);
+  if(capture.freeCount == 0) {
+    capture.dropped++;
+    SDL_UnlockMutex(capture.lock);
+    return;
+  }
+  int frame = capture.freeFrames[--capture.freeCount];
+  SDL_UnlockMutex(capture.lock);
+
+  // The copy happens outside the lock, the buffer is ours until queued
+  Uint8* dst = capture.frames[frame];
+  Uint8* src = (Uint8 *)screen->pixels;
+  int y;
+  for(y=0; y < capture.h; y++) {
+    memcpy(dst + y*capture.rowBytes, src + y*screen->pitch, capture.rowBytes);
+  }
+
+  SDL_LockMutex(capture.lock);
+  capture.queued[(capture.queueHead + capture.queueCount) % CAPTURE_POOL_SIZE] = frame;
+  capture.queueCount++;
+  SDL_CondSignal(capture.ready);
+  SDL_UnlockMutex(capture.lock);
+}
+
+/** Writer thread. Converts queued frames from the screen format and writes
+them out, then hands the buffers back to the pool. */
+int captureWriter(void* unused) {
+  SDL_PixelFormat* f  = &capture.format;
+  int              n  = capture.w * capture.h;
+
+  while(1) {
+    SDL_LockMutex(capture.lock);
+    while(capture.queueCount == 0 && !capture.stopping) {
+      SDL_CondWait(capture.ready, capture.lock);
+    }
+    if(capture.queueCount == 0) {
+      SDL_UnlockMutex(capture.lock);
+      break;
+    }
+    int frame = capture.queued[capture.queueHead];
+    capture.queueHead = (capture.queueHead + 1) % CAPTURE_POOL_SIZE;
+    capture.queueCount--;
+    SDL_UnlockMutex(capture.lock);
+
+    Uint32* pixels = (Uint32 *)capture.frames[frame];
+    Uint8*  out    = capture.scratch;
+    int     i;
+
+    for(i=0; i < n; i++) {
+      int r = (pixels[i] & f->Rmask) >> f->Rshift << f->Rloss;
+      int g = (pixels[i] & f->Gmask) >> f->Gshift << f->Gloss;
+      int b = (pixels[i] & f->Bmask) >> f->Bshift << f->Bloss;
+
+      if(capture.rgba) {
+        out[i*4+0] = r;
+        out[i*4+1] = g;
+        out[i*4+2] = b;
+        out[i*4+3] = 0xFF;
+      } else {
+        // Full range BT.601, one plane after another
+        out[i]       = (77*r + 150*g + 29*b) >> 8;
+        out[n+i]     = ((-43*r - 85*g + 128*b) >> 8) + 128;
+        out[2*n+i]   = ((128*r - 107*g - 21*b) >> 8) + 128;
+      }
+    }
+
+    if(!capture.failed) {
+      if(!capture.rgba) fputs("FRAME\n", capture.out);
+      if(fwrite(out, capture.rgba ? 4*n : 3*n, 1, capture.out) != 1) {
+        fprintf(stderr, "Capture output failed, dropping frames from now on\n");
+        capture.failed = true;
+      }
+    }
+
+    SDL_LockMutex(capture.lock);
+    if(capture.failed) capture.dropped++;
+    else               capture.written++;
+    capture.freeFrames[capture.freeCount++] = frame;
+    SDL_UnlockMutex(capture.lock);
+  }
+
+  return 0;
+}
+
+/** Flush the queued frames, stop the writer and release the pool */
+void stopCapture() {
+  if(!capture.out) return;
+
+  SDL_LockMutex(capture.lock);
+  capture.stopping = true;
+  SDL_CondSignal(capture.ready);
+  SDL_UnlockMutex(capture.lock);
+
+  SDL_WaitThread(capture.thread, NULL);
+
+  if(capture.isPipe)             pclose(capture.out);
+  else if(capture.out != stdout) fclose(capture.out);
+  else                           fflush(stdout);
+
+  fprintf(stderr, "Captured %ld frames, dropped %ld\n", capture.written, capture.dropped);
+
+  int i;
+  for(i=0; i < CAPTURE_POOL_SIZE; i++) {
+    free(capture.frames[i]);
+  }
+  free(capture.scratch);
+  SDL_DestroyCond(capture.ready);
+  SDL_DestroyMutex(capture.lock);
+  capture.out = NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Dataset Export
+///////////////////////////////////////////////////////////////////////////////
+
+/** Start exporting every placement to the given file, see dataset.h. Returns
+false if the file could not be opened. */
+int startDataset(const char* path) {
+  memset(&dataset, 0, sizeof(dataset));
+  dataset.out = fopen(path, "wb");
+  if(!dataset.out) return false;
+
+  memcpy(dataset.header.magic, DATASET_MAGIC, sizeof(dataset.header.magic));
+  dataset.header.version      = DATASET_VERSION;
+  dataset.header.width        = GRID_BLOCK_WIDTH;
+  dataset.header.height       = GRID_BLOCK_HEIGHT;
+  dataset.header.pieceLength  = BLOCK_COLUMN_LENGTH;
+  dataset.header.blockRecords = DATASET_BLOCK_RECORDS;
+
+  if(fwrite(&dataset.header, sizeof(dataset.header), 1, dataset.out) != 1) {
+    fprintf(stderr, "Dataset output failed, dropping placements from now on\n");
+    dataset.failed = true;
+  }
+  dataset.bytes = sizeof(dataset.header);
+
+  // Both buffers are allocated up front and swapped for every block. The
+  // board encoding grows by at most one control byte per 128 bytes.
+  int boardBytes = sizeof(dataset.buffers[0]->board);
+  dataset.buffers[0] = (DatasetBuffer *)malloc(sizeof(DatasetBuffer));
+  dataset.buffers[1] = (DatasetBuffer *)malloc(sizeof(DatasetBuffer));
+  dataset.buffers[0]->records = 0;
+  dataset.pending = -1;
+  dataset.scratch = (Uint8 *)malloc(boardBytes + boardBytes/128 + 2);
+
+  dataset.lock   = SDL_CreateMutex();
+  dataset.ready  = SDL_CreateCond();
+  dataset.done   = SDL_CreateCond();
+  dataset.thread = SDL_CreateThread(datasetWriter, NULL);
+
+  return true;
+}
+
+/** Add a placement to the export: the board the piece was dropped on, the
+piece's colors as spawned, where and how it was dropped and what came of it. */
+void recordPlacement(const Uint8* board, const Uint8* piece, int column, int rotation,
+                     int cleared, int chain, int ended) {
+  if(!dataset.out) return;
+
+  DatasetBuffer* b = dataset.buffers[dataset.filling];
+  int            r = b->records++;
+
+  memcpy(b->board + r*GRID_BLOCK_WIDTH*GRID_BLOCK_HEIGHT, board, GRID_BLOCK_WIDTH*GRID_BLOCK_HEIGHT);
+  memcpy(b->piece + r*BLOCK_COLUMN_LENGTH, piece, BLOCK_COLUMN_LENGTH);
+  b->column[r]   = column;
+  b->rotation[r] = rotation;
+  b->cleared[r]  = cleared;
+  b->chain[r]    = chain;
+  b->ended[r]    = ended;
+
+  if(b->records == DATASET_BLOCK_RECORDS) queueDatasetBuffer();
+}
+
+/** Record the column that just landed. The game clears once per landing, so
+the chain is 1 whenever anything was cleared. */
+void recordLanding(const Uint8* board, int column, int cleared, int ended) {
+  if(!dataset.out) return;
+
+  // Undo the color cycling to get the column as it spawned
+  Uint8 piece[BLOCK_COLUMN_LENGTH];
+  int   c;
+  for(c=0; c < BLOCK_COLUMN_LENGTH; c++) {
+    piece[c] = cellColor(columnBlocks[(c + columnRotation) % BLOCK_COLUMN_LENGTH].color);
+  }
+
+  recordPlacement(board, piece, column, columnRotation, cleared, cleared > 0, ended);
+}
+
+/** Hand the filled buffer to the writer and carry on in the other one. Only
+waits when the writer is still busy with the block before. */
+void queueDatasetBuffer() {
+  SDL_LockMutex(dataset.lock);
+  while(dataset.pending >= 0) {
+    SDL_CondWait(dataset.done, dataset.lock);
+  }
+  dataset.pending = dataset.filling;
+  SDL_CondSignal(dataset.ready);
+  SDL_UnlockMutex(dataset.lock);
+
+  dataset.filling = !dataset.filling;
+  dataset.buffers[dataset.filling]->records = 0;
+}
+
+/** Writer thread. Encodes and writes out each buffer it is handed. */
+int datasetWriter(void* unused) {
+  while(1) {
+    SDL_LockMutex(dataset.lock);
+    while(dataset.pending < 0 && !dataset.stopping) {
+      SDL_CondWait(dataset.ready, dataset.lock);
+    }
+    if(dataset.pending < 0) {
+      SDL_UnlockMutex(dataset.lock);
+      break;
+    }
+    DatasetBuffer* b = dataset.buffers[dataset.pending];
+    SDL_UnlockMutex(dataset.lock);
+
+    if(!dataset.failed) writeDatasetBlock(b);
+
+    SDL_LockMutex(dataset.lock);
+    dataset.pending = -1;
+    SDL_CondSignal(dataset.done);
+    SDL_UnlockMutex(dataset.lock);
+  }
+
+  return 0;
+}
+
+/** Write a buffer out as one block. Columns follow the block header in
+order, each padded to DATASET_ALIGN. */
+void writeDatasetBlock(DatasetBuffer* b) {
+  static const Uint8 padding[DATASET_ALIGN] = {0};
+
+  DatasetBlock block;
+  const void*  data[DATASET_COLUMNS];
+  int          c;
+
+  memset(&block, 0, sizeof(block));
+  block.magic   = DATASET_BLOCK_MAGIC;
+  block.records = b->records;
+
+  data[DATASET_BOARD]    = b->board;
+  data[DATASET_PIECE]    = b->piece;
+  data[DATASET_COLUMN]   = b->column;
+  data[DATASET_ROTATION] = b->rotation;
+  data[DATASET_CLEARED]  = b->cleared;
+  data[DATASET_CHAIN]    = b->chain;
+  data[DATASET_ENDED]    = b->ended;
+
+  for(c=0; c < DATASET_COLUMNS; c++) {
+    block.columns[c].size     = b->records * datasetColumnWidth(&dataset.header, c);
+    block.columns[c].encoding = DATASET_RAW;
+  }
+
+  // A placement only changes a few cells, so boards are stored as run
+  // length coded differences whenever that comes out smaller
+  int encoded = encodeXorRle(b->board, GRID_BLOCK_WIDTH*GRID_BLOCK_HEIGHT, b->records, dataset.scratch);
+  if(encoded < block.columns[DATASET_BOARD].size) {
+    data[DATASET_BOARD]                   = dataset.scratch;
+    block.columns[DATASET_BOARD].size     = encoded;
+    block.columns[DATASET_BOARD].encoding = DATASET_XOR_RLE;
+  }
+
+  Uint32 offset = sizeof(block);
+  for(c=0; c < DATASET_COLUMNS; c++) {
+    block.columns[c].offset = offset;
+    offset += (block.columns[c].size + DATASET_ALIGN-1) & ~(DATASET_ALIGN-1);
+  }
+  block.size = offset;
+
+  int ok = fwrite(&block, sizeof(block), 1, dataset.out) == 1;
+  for(c=0; c < DATASET_COLUMNS && ok; c++) {
+    Uint32 size = block.columns[c].size;
+    Uint32 pad  = ((size + DATASET_ALIGN-1) & ~(DATASET_ALIGN-1)) - size;
+    if(size > 0) ok = fwrite(data[c], size, 1, dataset.out) == 1;
+    if(pad > 0)  ok = ok && fwrite(padding, pad, 1, dataset.out) == 1;
+  }
+
+  if(!ok) {
+    fprintf(stderr, "Dataset output failed, dropping placements from now on\n");
+    dataset.failed = true;
+    return;
+  }
+
+  dataset.records += b->records;
+  dataset.blocks++;
+  dataset.bytes   += block.size;
+}
+
+/** Byte i of a run of records XORed with the same byte of the record before */
+Uint8 recordDelta(const Uint8* records, int width, int i) {
+  return i < width ? records[i] : records[i] ^ records[i - width];
+}
+
+/** Run length code the differences between consecutive records, see
+dataset.h. Returns the encoded size. */
+int encodeXorRle(const Uint8* records, int width, int count, Uint8* out) {
+  int n   = width * count;
+  int len = 0;
+  int i   = 0;
+
+  while(i < n) {
+    // Unchanged bytes, single ones only at the very end
+    int run = 0;
+    while(i+run < n && run < 128 && recordDelta(records, width, i+run) == 0) run++;
+    if(run >= 2 || (run == 1 && i+1 == n)) {
+      out[len++] = 0x80 | (run-1);
+      i += run;
+      continue;
+    }
+
+    // Changed bytes up to the next run of unchanged ones
+    int control  = len++;
+    int literals = 0;
+    while(i < n && literals < 128) {
+      if(i+1 < n && recordDelta(records, width, i) == 0
+                 && recordDelta(records, width, i+1) == 0) break;
+      out[len++] = recordDelta(records, width, i);
+      literals++;
+      i++;
+    }
+    out[control] = literals-1;
+  }
+
+  return len;
+}
+
+/** Write out what is still buffered, stop the writer and release the
+buffers */
+void stopDataset() {
+  if(!dataset.out) return;
+
+  if(dataset.buffers[dataset.filling]->records > 0) queueDatasetBuffer();
+
+  SDL_LockMutex(dataset.lock);
+  dataset.stopping = true;
+  SDL_CondSignal(dataset.ready);
+  SDL_UnlockMutex(dataset.lock);
+
+  SDL_WaitThread(dataset.thread, NULL);
+
+  fclose(dataset.out);
+
+  fprintf(stderr, "Exported %ld placements in %ld blocks, %ld bytes\n",
+          dataset.records, dataset.blocks, dataset.bytes);
+
+  free(dataset.buffers[0]);
+  free(dataset.buffers[1]);
+  free(dataset.scratch);
+  SDL_DestroyCond(dataset.done);
+  SDL_DestroyCond(dataset.ready);
+  SDL_DestroyMutex(dataset.lock);
+  dataset.out = NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Headless Simulation
+///////////////////////////////////////////////////////////////////////////////
+
+/** Drop a piece (top first) into a column of a board and resolve it: clear
+matches, let everything fall and repeat until nothing matches. Returns the
+blocks cleared, chain is set to the rounds it took and ended to whether the
+piece reached the top like it does in moveColumnDown. */
+int dropPiece(Uint8* cells, const Uint8* piece, int column, int* chain, int* ended) {
+  Uint8* slots = cells + column*GRID_BLOCK_HEIGHT;
+  int    top   = 0;
+  int    c;
+
+  while(top < GRID_BLOCK_HEIGHT && !slots[top]) top++;
+
+  for(c=0; c < BLOCK_COLUMN_LENGTH; c++) {
+    int row = top - BLOCK_COLUMN_LENGTH + c;
+    if(row >= 0) slots[row] = piece[c];
+  }
+
+  *ended = top - 1 - BLOCK_COLUMN_LENGTH <= 0;
+  *chain = 0;
+
+  int cleared = 0;
+  while(1) {
+    Uint32 marks[GRID_BLOCK_WIDTH];
+    int    found = 0;
+    int    x,y;
+
+    findMatches(cells, marks);
+    for(x=0; x < GRID_BLOCK_WIDTH; x++) {
+      for(y=0; y < GRID_BLOCK_HEIGHT; y++) {
+        if(marks[x] & (1u << y)) {
+          cells[x*GRID_BLOCK_HEIGHT + y] = 0;
+          found++;
         }
-    
-        // Move to the horizonal left
-        hlGridX --;
-        hlValid = hlValid && hlGridX >= 0;
-    
-        if(hlValid) {
-          Block tBlock = placedBlocks[hlGridX][gridY];
-          if(tBlock.occupied && tBlock.color == block.color) {
-            tItem = (BlockRemItem *)malloc(sizeof(BlockRemItem));       
-            tItem->x = tBlock.x;
-            tItem->y = tBlock.y;
-            tItem->next = NULL;
-
-            addItemToRemList(&hBlocksToRemove, tItem);
-          } else {
-            hlValid = false;
-          }
-        } 
+      }
+    }
 
-      
-        // Move to the top
-        vuGridY--;
-        vuValid = vuValid && vuGridY >= 0;
-        
-        if(vuValid) {
-          Block tBlock = placedBlocks[gridX][vuGridY];
-          if(tBlock.occupied && tBlock.color == block.color) {
-            tItem = (BlockRemItem *)malloc(sizeof(BlockRemItem));       
-            tItem->x = tBlock.x;
-            tItem->y = tBlock.y;
-            tItem->next = NULL;          
-
-            addItemToRemList(&vBlocksToRemove, tItem);
-          } else {
-            vuValid = false;
+    if(!found) break;
+
+    cleared += found;
+    (*chain)++;
+    settleCells(cells);
+  }
+
+  return cleared;
+}
+
+/** Play games without a window as fast as the board kernels go, recording
+every placement. Each piece goes wherever it clears the most without ending
+the game, ties are broken at random. One in SIMULATE_EXPLORE pieces goes
+somewhere random instead, which also keeps games from going on forever.
+Returns the number of placements. */
+long simulateGames(int games) {
+  Uint8 cells[GRID_BLOCK_WIDTH * GRID_BLOCK_HEIGHT];
+  Uint8 before[GRID_BLOCK_WIDTH * GRID_BLOCK_HEIGHT];
+  Uint8 piece[BLOCK_COLUMN_LENGTH];
+  Uint8 rotated[BLOCK_COLUMN_LENGTH];
+  long  placements = 0;
+  int   g, c;
+
+  for(g=0; g < games; g++) {
+    int ended = false;
+    memset(cells, 0, sizeof(cells));
+
+    while(!ended) {
+      for(c=0; c < BLOCK_COLUMN_LENGTH; c++) {
+        piece[c] = cellColor(getRandomColor());
+      }
+
+      int bestColumn = 0, bestRotation = 0, bestValue = -1, ties = 0;
+      int x, r, chain, cleared;
+
+      if(rand() % SIMULATE_EXPLORE == 0) {
+        bestColumn   = rand() % GRID_BLOCK_WIDTH;
+        bestRotation = rand() % BLOCK_COLUMN_LENGTH;
+      } else {
+        // Try every column and rotation on a copy of the board
+        for(x=0; x < GRID_BLOCK_WIDTH; x++) {
+          for(r=0; r < BLOCK_COLUMN_LENGTH; r++) {
+            for(c=0; c < BLOCK_COLUMN_LENGTH; c++) {
+              rotated[c] = piece[(c - r + BLOCK_COLUMN_LENGTH) % BLOCK_COLUMN_LENGTH];
+            }
+            memcpy(before, cells, sizeof(cells));
+            cleared = dropPiece(before, rotated, x, &chain, &ended);
+
+            int value = ended ? 0 : cleared + 1;
+            if(value > bestValue) {
+              bestValue = value;
+              ties      = 1;
+            } else if(value < bestValue || rand() % ++ties != 0) {
+              continue;
+            }
+            bestColumn   = x;
+            bestRotation = r;
           }
         }
+      }
 
-        // Move to the bottom
-        vdGridY++;
-        vdValid = vdValid && vdGridY < GRID_HEIGHT;
-        
-        if(vdValid) {
-          Block tBlock = placedBlocks[gridX][vdGridY];
-          if(tBlock.occupied && tBlock.color == block.color) {
-            tItem = (BlockRemItem *)malloc(sizeof(BlockRemItem));       
-            tItem->x = tBlock.x;
-            tItem->y = tBlock.y;
-            tItem->next = NULL;          
-          
-            addItemToRemList(&vBlocksToRemove, tItem);
-          } else {
-            vdValid = false;
-          }
-        }        
+      for(c=0; c < BLOCK_COLUMN_LENGTH; c++) {
+        rotated[c] = piece[(c - bestRotation + BLOCK_COLUMN_LENGTH) % BLOCK_COLUMN_LENGTH];
       }
-  
-      if(getItemToRemListLength(&hBlocksToRemove) >= BLOCKS_TO_MATCH) {
-        foundBlocksToRemove = true;
-
-        tItem = (BlockRemItem *)malloc(sizeof(BlockRemItem));       
-        tItem->x = block.x;
-        tItem->y = block.y;
-        tItem->next = NULL;
-        addItemToRemList(&hBlocksToRemove, tItem);      
-
-        BlockRemItem* curr = &hBlocksToRemove;
-        while(curr) {
-          BlockRemItem temp = *curr;
-          if(curr->x >= 0 && curr->y >= 0) {
-            placedBlocks[curr->x/BLOCK_WIDTH][curr->y/BLOCK_HEIGHT].occupied = false;
-            placedBlocks[curr->x/BLOCK_WIDTH][curr->y/BLOCK_HEIGHT].color    = COLOR_BLACK;
-          }
+      memcpy(before, cells, sizeof(cells));
+      cleared = dropPiece(cells, rotated, bestColumn, &chain, &ended);
+
+      recordPlacement(before, piece, bestColumn, bestRotation, cleared, chain, ended);
+      placements++;
+    }
+  }
+
+  return placements;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Timers
+///////////////////////////////////////////////////////////////////////////////
 
-          curr = curr->next;
+void initTimers(double currentTime) {
+  memset(&timers, 0, sizeof(timers));
+  timers.start = currentTime;
+}
+
+/** Register a callback to run delay seconds from the last time the timers
+ran, then every interval seconds (0 for once). Returns NULL when all
+MAX_TIMERS are in use. */
+Timer* addTimer(double delay, double interval, TimerCallback callback) {
+  int i;
+  for(i=0; i < MAX_TIMERS; i++) {
+    Timer* timer = &timers.pool[i];
+    if(timer->active) continue;
+
+    timer->active   = true;
+    timer->deadline = timers.start + timers.currentTick * TIMER_TICK + delay;
+    timer->interval = interval;
+    timer->callback = callback;
+    scheduleTimer(timer);
+    return timer;
+  }
+
+  fprintf(stderr, "Out of timers\n");
+  return NULL;
+}
+
+/** Hash an active timer into the slot of its deadline. Timers never go into
+a tick that has already been run. */
+void scheduleTimer(Timer* timer) {
+  timer->tick = (long)ceil((timer->deadline - timers.start) / TIMER_TICK);
+  if(timer->tick <= timers.currentTick) {
+    timer->tick = timers.currentTick + 1;
+  }
+
+  // Append so timers due in the same tick fire in the order they were added
+  Timer** link = &timers.slots[timer->tick % TIMER_WHEEL_SLOTS];
+  while(*link) link = &(*link)->next;
+  timer->next = NULL;
+  *link       = timer;
+}
+
+/** Run every callback that is due by currentTime, in deadline order. Timers
+due in the same tick run in the order they were scheduled. */
+void runTimers(double currentTime) {
+  long nowTick = (long)((currentTime - timers.start) / TIMER_TICK);
+  if(nowTick <= timers.currentTick) return;
+
+  // Pull everything that is due off the wheel first so callbacks can add
+  // timers while we run them. After a full turn every slot has been seen.
+  Timer*  due     = NULL;
+  Timer** dueTail = &due;
+  Timer*  last    = NULL;
+  long    ticks   = nowTick - timers.currentTick;
+  long    t;
+
+  if(ticks > TIMER_WHEEL_SLOTS) ticks = TIMER_WHEEL_SLOTS;
+
+  for(t=1; t <= ticks; t++) {
+    Timer** link = &timers.slots[(timers.currentTick + t) % TIMER_WHEEL_SLOTS];
+    while(*link) {
+      Timer* timer = *link;
+      if(timer->tick <= nowTick) {
+        *link = timer->next;
+
+        // Slots come up in tick order unless the wheel went round more than
+        // once, then later ticks can be seen first and have to be passed
+        if(!last || last->tick <= timer->tick) {
+          timer->next = NULL;
+          *dueTail    = timer;
+          dueTail     = &timer->next;
+          last        = timer;
+        } else {
+          Timer** at = &due;
+          while((*at)->tick <= timer->tick) at = &(*at)->next;
+          timer->next = *at;
+          *at         = timer;
         }
+      } else {
+        link = &timer->next;
       }
+    }
+  }
 
-      if(getItemToRemListLength(&vBlocksToRemove) >= BLOCKS_TO_MATCH) {
-        foundBlocksToRemove = true;
+  timers.currentTick = nowTick;
 
-        tItem = (BlockRemItem *)malloc(sizeof(BlockRemItem));       
-        tItem->x = block.x;
-        tItem->y = block.y;
-        tItem->next = NULL;
-        addItemToRemList(&vBlocksToRemove, tItem);      
+  while(due) {
+    Timer* timer = due;
+    due = timer->next;
 
-        BlockRemItem* curr = &vBlocksToRemove;
-        while(curr) {
-          if(curr->x >= 0 && curr->y >= 0) {
-            placedBlocks[curr->x/BLOCK_WIDTH][curr->y/BLOCK_HEIGHT].occupied = false;
-            placedBlocks[curr->x/BLOCK_WIDTH][curr->y/BLOCK_HEIGHT].color    = COLOR_BLACK;
-          }
-          curr = curr->next;
-        }
+    timer->callback(currentTime);
+
+    if(timer->interval <= 0) {
+      timer->active = false;
+      continue;
+    }
+
+    // Keep a steady cadence, but skip beats we are too late for instead of
+    // running them back to back
+    timer->deadline += timer->interval;
+    if(timer->deadline <= currentTime) {
+      timer->deadline = currentTime + timer->interval;
+    }
+    scheduleTimer(timer);
+  }
+}
+
+/** The earliest deadline of all active timers. Looks at the slots coming
+up in order and stops at the first timer due in its slot's next tick, so the
+cost is the distance to the next deadline, at most one turn of the wheel. */
+double nextTimerDeadline() {
+  long earliest = timers.currentTick + 1;
+  int  found    = false;
+  long t;
+
+  for(t=1; t <= TIMER_WHEEL_SLOTS; t++) {
+    long   tick  = timers.currentTick + t;
+    Timer* timer = timers.slots[tick % TIMER_WHEEL_SLOTS];
+
+    for(; timer; timer = timer->next) {
+      if(timer->tick == tick) return timers.start + tick * TIMER_TICK;
+
+      // Due a turn or more later, only counts if nothing closer turns up
+      if(!found || timer->tick < earliest) {
+        earliest = timer->tick;
+        found    = true;
       }
+    }
+  }
 
-      if(getItemToRemListLength(&fdBlocksToRemove) >= BLOCKS_TO_MATCH) {
-        foundBlocksToRemove = true;
-
-        tItem = (BlockRemItem *)malloc(sizeof(BlockRemItem));       
-        tItem->x = block.x;
-        tItem->y = block.y;
-        tItem->next = NULL;
-        addItemToRemList(&fdBlocksToRemove, tItem);      
-
-        BlockRemItem* curr = &fdBlocksToRemove;
-        while(curr) {
-          BlockRemItem* temp = curr;
-          if(curr->x >= 0 && curr->y >= 0) {
-            placedBlocks[curr->x/BLOCK_WIDTH][curr->y/BLOCK_HEIGHT].occupied = false;
-            placedBlocks[curr->x/BLOCK_WIDTH][curr->y/BLOCK_HEIGHT].color    = COLOR_BLACK;
-          }
-         curr = curr->next;
+  return timers.start + earliest * TIMER_TICK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// HUD
+///////////////////////////////////////////////////////////////////////////////
+
+/** Surface in the backbuffer's format, filled with the HUD's transparent
+color */
+SDL_Surface* createHudSurface(int w, int h) {
+  SDL_PixelFormat* f = backbuffer->format;
+  SDL_Surface*     s = SDL_CreateRGBSurface(SDL_SWSURFACE, w, h, DEPTH,
+                                            f->Rmask, f->Gmask, f->Bmask, f->Amask);
+  if(!s) return NULL;
+
+  SDL_FillRect(s, NULL, hud.key);
+  SDL_SetColorKey(s, SDL_SRCCOLORKEY, hud.key);
+  return s;
+}
+
+/** Rasterize the built in font into the glyph atlas, once. Glyphs get a
+dark drop shadow so they read on top of any block color. Everything is
+made in the backbuffer's format because that is where the HUD is drawn. */
+void buildHud() {
+  int chars = (int)strlen(FONT_CHARS);
+  int i, c, x, y;
+
+  memset(&hud, 0, sizeof(hud));
+  hud.key = SDL_MapRGB(backbuffer->format, 0xFF, 0x00, 0xFF);
+
+  hud.glyphs = createHudSurface(chars * GLYPH_WIDTH, GLYPH_HEIGHT);
+  if(!hud.glyphs) return;
+
+  Uint32 ink    = SDL_MapRGB(backbuffer->format, 0xFF, 0xFF, 0xFF);
+  Uint32 shadow = SDL_MapRGB(backbuffer->format, 0x20, 0x20, 0x20);
+
+  // Shadows first so no shadow lands on top of a neighbouring dot
+  int pass;
+  for(pass=0; pass < 2; pass++) {
+    int offset = pass == 0 ? FONT_SCALE/2 : 0;
+
+    for(c=0; c < chars; c++) {
+      for(y=0; y < FONT_HEIGHT; y++) {
+        for(x=0; x < FONT_WIDTH; x++) {
+          if(!(FONT[c][y] & (0x10 >> x))) continue;
+
+          SDL_Rect dot = {c*GLYPH_WIDTH + x*FONT_SCALE + offset, y*FONT_SCALE + offset,
+                          FONT_SCALE, FONT_SCALE};
+          SDL_FillRect(hud.glyphs, &dot, pass == 0 ? shadow : ink);
         }
-      }    
-
-      if(getItemToRemListLength(&bdBlocksToRemove) >= BLOCKS_TO_MATCH) {
-        foundBlocksToRemove = true;
-
-        tItem = (BlockRemItem *)malloc(sizeof(BlockRemItem));       
-        tItem->x = block.x;
-        tItem->y = block.y;
-        tItem->next = NULL;
-        addItemToRemList(&bdBlocksToRemove, tItem);          
-
-        BlockRemItem* curr = &bdBlocksToRemove;
-        while(curr) {
-          if(curr->x >= 0 && curr->y >= 0) {
-            placedBlocks[curr->x/BLOCK_WIDTH][curr->y/BLOCK_HEIGHT].occupied = false;
-            placedBlocks[curr->x/BLOCK_WIDTH][curr->y/BLOCK_HEIGHT].color    = COLOR_BLACK;
-          }
-          curr = curr->next;
-        }                        
-      }    
+      }
     }
   }
-}
\ No newline at end of file
+
+  SDL_SetColorKey(hud.glyphs, SDL_SRCCOLORKEY|SDL_RLEACCEL, hud.key);
+
+  for(i=0; i < HUD_LINES; i++) {
+    hud.lines[i].surface = createHudSurface((HUD_TEXT_LENGTH-1) * GLYPH_WIDTH, GLYPH_HEIGHT);
+  }
+  hud.surface = createHudSurface((HUD_TEXT_LENGTH-1) * GLYPH_WIDTH, HUD_LINES * GLYPH_HEIGHT);
+}
+
+void freeHud() {
+  int i;
+  for(i=0; i < HUD_LINES; i++) {
+    if(hud.lines[i].surface) SDL_FreeSurface(hud.lines[i].surface);
+  }
+  if(hud.surface) SDL_FreeSurface(hud.surface);
+  if(hud.glyphs)  SDL_FreeSurface(hud.glyphs);
+  memset(&hud, 0, sizeof(hud));
+}
+
+/** Change the text of a HUD line. Only rasterizes when the text differs
+from what the line already shows. */
+void setHudText(int line, const char* text) {
+  HudLine* l = &hud.lines[line];
+  if(!l->surface || strncmp(l->text, text, HUD_TEXT_LENGTH-1) == 0) return;
+
+  strncpy(l->text, text, HUD_TEXT_LENGTH-1);
+  l->text[HUD_TEXT_LENGTH-1] = '\0';
+
+  SDL_FillRect(l->surface, NULL, hud.key);
+
+  int i;
+  for(i=0; l->text[i]; i++) {
+    const char* glyph = strchr(FONT_CHARS, l->text[i]);
+    int         c     = glyph ? (int)(glyph - FONT_CHARS) : 0;
+    if(c == 0) continue;
+
+    SDL_Rect src = {c * GLYPH_WIDTH, 0, GLYPH_WIDTH, GLYPH_HEIGHT};
+    SDL_Rect dst = {i * GLYPH_WIDTH, 0, GLYPH_WIDTH, GLYPH_HEIGHT};
+    SDL_BlitSurface(hud.glyphs, &src, l->surface, &dst);
+  }
+
+  hud.dirty = true;
+}
+
+/** Refresh the HUD text from the game state. Cheap when nothing changed. */
+void updateHud() {
+  char text[HUD_TEXT_LENGTH];
+
+  snprintf(text, sizeof(text), "SCORE %d", score);
+  setHudText(0, text);
+
+  snprintf(text, sizeof(text), "FPS %d", framesPerSecond);
+  setHudText(1, text);
+
+  setHudText(2, gameOver ? "GAME OVER" : "");
+}
+
+/** Blit the HUD, recomposing it first if a line changed */
+void drawHud(SDL_Surface* screen) {
+  if(!hud.surface) return;
+
+  if(hud.dirty) {
+    int i;
+    SDL_FillRect(hud.surface, NULL, hud.key);
+    for(i=0; i < HUD_LINES; i++) {
+      SDL_Rect dst = {0, i * GLYPH_HEIGHT, 0, 0};
+      SDL_BlitSurface(hud.lines[i].surface, NULL, hud.surface, &dst);
+    }
+    hud.dirty = false;
+  }
+
+  SDL_Rect dst = {HUD_MARGIN, HUD_MARGIN, 0, 0};
+  SDL_BlitSurface(hud.surface, NULL, screen, &dst);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Particles
+///////////////////////////////////////////////////////////////////////////////
+
+/** Uniform float in [0, 1) from the particle random stream */
+float particleRandom() {
+  Uint32 r = particles.seed ? particles.seed : 0x9E3779B9;
+  r ^= r << 13;
+  r ^= r >> 17;
+  r ^= r << 5;
+  particles.seed = r;
+  return (r >> 8) * (1.0f / 16777216.0f);
+}
+
+/** Burst of particles from the center of a cleared block. Once the pool is
+full further particles are simply not spawned. */
+void spawnParticles(int x, int y, int *rgb) {
+  if(!backbuffer) return;
+
+  Uint32 pixel = SDL_MapRGB(backbuffer->format, rgb[0], rgb[1], rgb[2]);
+
+  int i;
+  for(i=0; i < PARTICLES_PER_BLOCK && particles.count < MAX_PARTICLES; i++) {
+    int   n     = particles.count++;
+    float angle = particleRandom() * 6.2831853f;
+    float speed = 60.0f + particleRandom() * 240.0f;
+
+    particles.x[n]     = x + (particleRandom() - .5f) * BLOCK_WIDTH;
+    particles.y[n]     = y + (particleRandom() - .5f) * BLOCK_HEIGHT;
+    particles.vx[n]    = cosf(angle) * speed;
+    particles.vy[n]    = sinf(angle) * speed - 150.0f;
+    particles.life[n]  = PARTICLE_LIFE * (.5f + particleRandom() * .5f);
+    particles.pixel[n] = pixel;
+  }
+}
+
+/** Particle timer callback. Integrates every live particle over the time
+since the last update, then packs the survivors at the front of the pool. */
+void updateParticles(double currentTime) {
+  float dt = (float)(currentTime - particles.lastUpdate);
+  particles.lastUpdate = currentTime;
+
+  if(particles.count == 0) return;
+  if(dt > .1f) dt = .1f;
+
+  int   n    = particles.count;
+  float fall = PARTICLE_GRAVITY * dt;
+  int   i    = 0;
+
+#if defined(__SSE2__)
+  __m128 vdt   = _mm_set1_ps(dt);
+  __m128 vfall = _mm_set1_ps(fall);
+  for(; i+4 <= n; i += 4) {
+    __m128 vy = _mm_add_ps(_mm_loadu_ps(particles.vy + i), vfall);
+    _mm_storeu_ps(particles.vy + i, vy);
+    _mm_storeu_ps(particles.x + i, _mm_add_ps(_mm_loadu_ps(particles.x + i),
+                                              _mm_mul_ps(_mm_loadu_ps(particles.vx + i), vdt)));
+    _mm_storeu_ps(particles.y + i, _mm_add_ps(_mm_loadu_ps(particles.y + i), _mm_mul_ps(vy, vdt)));
+    _mm_storeu_ps(particles.life + i, _mm_sub_ps(_mm_loadu_ps(particles.life + i), vdt));
+  }
+#elif defined(__ARM_NEON)
+  float32x4_t vdt   = vdupq_n_f32(dt);
+  float32x4_t vfall = vdupq_n_f32(fall);
+  for(; i+4 <= n; i += 4) {
+    float32x4_t vy = vaddq_f32(vld1q_f32(particles.vy + i), vfall);
+    vst1q_f32(particles.vy + i, vy);
+    vst1q_f32(particles.x + i, vmlaq_f32(vld1q_f32(particles.x + i), vld1q_f32(particles.vx + i), vdt));
+    vst1q_f32(particles.y + i, vmlaq_f32(vld1q_f32(particles.y + i), vy, vdt));
+    vst1q_f32(particles.life + i, vsubq_f32(vld1q_f32(particles.life + i), vdt));
+  }
+#endif
+
+  for(; i < n; i++) {
+    particles.vy[i]   += fall;
+    particles.x[i]    += particles.vx[i] * dt;
+    particles.y[i]    += particles.vy[i] * dt;
+    particles.life[i] -= dt;
+  }
+
+  // Drop particles that burnt out or fell off the board, in place
+  int live = 0;
+  for(i=0; i < n; i++) {
+    if(particles.life[i] <= 0 || particles.y[i] >= GRID_HEIGHT) continue;
+
+    if(live != i) {
+      particles.x[live]     = particles.x[i];
+      particles.y[live]     = particles.y[i];
+      particles.vx[live]    = particles.vx[i];
+      particles.vy[live]    = particles.vy[i];
+      particles.life[live]  = particles.life[i];
+      particles.pixel[live] = particles.pixel[i];
+    }
+    live++;
+  }
+  particles.count = live;
+}
+
+/** Plot every particle as a 2x2 dot straight into the surface pixels */
+void drawParticles(SDL_Surface* screen) {
+  if(particles.count == 0) return;
+
+  if(SDL_MUSTLOCK(screen)) {
+    if(SDL_LockSurface(screen) < 0) return;
+  }
+
+  Uint8* pixels = (Uint8 *)screen->pixels;
+  int    pitch  = screen->pitch;
+  int    i;
+
+  for(i=0; i < particles.count; i++) {
+    int x = (int)particles.x[i];
+    int y = (int)particles.y[i];
+    if(x < 0 || y < 0 || x >= screen->w - 1 || y >= screen->h - 1) continue;
+
+    Uint32* row = (Uint32 *)(pixels + y * pitch) + x;
+    row[0] = row[1] = particles.pixel[i];
+    row    = (Uint32 *)((Uint8 *)row + pitch);
+    row[0] = row[1] = particles.pixel[i];
+  }
+
+  if(SDL_MUSTLOCK(screen)) SDL_UnlockSurface(screen);
+}
@@ -1,2 +1,2 @@
 #!/bin/bash
-gcc -I/Library/Frameworks/SDL.framework/Headers blocks.c SDLmain.m -framework SDL -framework Cocoa -o blocks
\ No newline at end of file
+gcc -O2 -I/Library/Frameworks/SDL.framework/Headers blocks.c SDLmain.m -framework SDL -framework Cocoa -o blocks
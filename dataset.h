@@ -0,0 +1,80 @@
+/*   dataset.h - on-disk layout of the placement datasets
+
+    Written by "blocks -record" and read by tools/read_dataset. A dataset is
+    a DatasetHeader followed by blocks of up to blockRecords records. Each
+    block is a DatasetBlock followed by one run of bytes per column, every
+    run starting on a DATASET_ALIGN boundary. Everything is in host byte
+    order so a reader can mmap the file and use the structs and raw columns
+    in place.
+
+    Columns are DATASET_RAW, or DATASET_XOR_RLE for the board: every record
+    is XORed with the one before it in the block (the first with zeros) and
+    the resulting bytes are run length coded. A control byte c is followed
+    by c+1 literal bytes when c < 0x80, otherwise it stands for
+    (c & 0x7F) + 1 zero bytes.
+*/
+
+#ifndef _dataset_h_
+#define _dataset_h_
+
+#include <stdint.h>
+
+#define DATASET_MAGIC       "BLOCKSDS"
+#define DATASET_VERSION     1
+#define DATASET_BLOCK_MAGIC 0x4B4C4244
+#define DATASET_ALIGN       8
+
+// Columns, in the order they are stored in a block
+enum {
+  DATASET_BOARD,     // uint8_t[width*height], column major color ids, 0 empty
+  DATASET_PIECE,     // uint8_t[pieceLength], colors as spawned, top first
+  DATASET_COLUMN,    // uint8_t, grid column the piece was dropped in
+  DATASET_ROTATION,  // uint8_t, times the colors were cycled before the drop
+  DATASET_CLEARED,   // uint16_t, blocks cleared by the drop
+  DATASET_CHAIN,     // uint8_t, rounds of clearing the drop set off
+  DATASET_ENDED,     // uint8_t, 1 if the drop ended the game
+  DATASET_COLUMNS
+};
+
+// Column encodings
+enum {
+  DATASET_RAW,
+  DATASET_XOR_RLE
+};
+
+typedef struct {
+  char     magic[8];
+  uint32_t version;
+  uint16_t width;
+  uint16_t height;
+  uint16_t pieceLength;
+  uint16_t reserved;
+  uint32_t blockRecords;
+} DatasetHeader;
+
+typedef struct {
+  uint32_t offset;   // From the start of the block
+  uint32_t size;     // Bytes stored, before padding
+  uint32_t encoding;
+  uint32_t reserved;
+} DatasetColumn;
+
+typedef struct {
+  uint32_t      magic;
+  uint32_t      records;
+  uint32_t      size;  // The whole block, header and padding included
+  uint32_t      reserved;
+  DatasetColumn columns[DATASET_COLUMNS];
+} DatasetBlock;
+
+/** Bytes one record takes up in a column before encoding */
+static inline uint32_t datasetColumnWidth(const DatasetHeader* header, int column) {
+  switch(column) {
+    case DATASET_BOARD:   return header->width * header->height;
+    case DATASET_PIECE:   return header->pieceLength;
+    case DATASET_CLEARED: return sizeof(uint16_t);
+    default:              return sizeof(uint8_t);
+  }
+}
+
+#endif /* _dataset_h_ */
@@ -0,0 +1,781 @@
+/** Differential fuzzer for the board kernels in blocks.c.
+
+Every input decodes to a board, a falling column and a move direction. The
+kernels from the game (clearAndScore, compactBlocks, moveColumnLeft/Right and
+the landing in moveColumnDown) are run on that state and compared against a
+slow reference model of the rules below. The board is also tiled over other
+shapes to check every specialized and the generic match and settle kernels
+on their own. Any difference is minimized, written
+out as a reproducer and reported with abort() so libFuzzer, AFL and the
+sanitizers all treat it as a crash.
+
+See fuzz/compile.sh for the build modes. */
+
+#define BLOCKS_NO_MAIN
+#include "../blocks.c"
+#undef main
+
+#define NUM_COLORS   5
+#define HEADER_SIZE  8
+#define RAW_SIZE     (GRID_BLOCK_WIDTH * GRID_BLOCK_HEIGHT)
+#define MAX_TICKS    (4 * GRID_BLOCK_HEIGHT * GRID_BLOCK_HEIGHT)
+
+// Generators, selected by the first input byte
+enum { GEN_RAW, GEN_NOISE, GEN_RUNS, GEN_STACKS, GEN_COUNT };
+
+// Kernels under test
+enum { K_CLEAR, K_COMPACT, K_SHIFT, K_LAND, K_SHAPES, K_COUNT };
+
+const char* kernelNames[K_COUNT] = {
+  "clearAndScore", "compactBlocks", "moveColumnLeft/Right", "moveColumnDown",
+  "board kernels"
+};
+
+// A board shape the board kernels are run at directly. With highIds set
+// colors 4 and 5 become MAX_CELL_COLOR and ids above it, which the kernels
+// have to treat as one color.
+typedef struct {
+  int w;
+  int h;
+  int match;
+  int highIds;
+} Shape;
+
+// Besides every boardKernels[] shape, the generic kernels are run from a
+// single cell up to the largest board they take
+#define NUM_SHAPES 10
+
+const Shape shapes[NUM_SHAPES] = {
+  { 1,  1,  1, 0}, { 1,  9,  2, 1}, { 9,  1,  3, 0}, { 3,  5,  2, 1},
+  { 7,  9,  5, 0}, {13,  7,  7, 1}, { 5, 32,  4, 0}, {32,  5,  3, 1},
+  {32, 32,  3, 1}, {32, 32, 32, 0}
+};
+
+int* palette[NUM_COLORS];
+
+long checksRun[K_COUNT];
+
+///////////////////////////////////////////////////////////////////////////////
+// Scenario decoding
+///////////////////////////////////////////////////////////////////////////////
+
+typedef struct {
+  int cells[GRID_BLOCK_WIDTH][GRID_BLOCK_HEIGHT]; // 0 = empty, 1..NUM_COLORS
+  int columnX;                                    // grid x of the column
+  int columnStep;                                 // bottom block y in half blocks
+  int columnColors[BLOCK_COLUMN_LENGTH];          // 1..NUM_COLORS
+  int direction;                                  // -1 left, 1 right
+  int clampStep;                                  // raw inputs clamp the step
+} Scenario;
+
+typedef struct {
+  const uint8_t* data;
+  size_t         size;
+  size_t         pos;
+  uint32_t       state;
+} ByteStream;
+
+/** Next payload byte, or a pseudo random one once the payload runs out */
+uint8_t nextByte(ByteStream* bs) {
+  if(bs->pos < bs->size) return bs->data[bs->pos++];
+
+  bs->state ^= bs->state << 13;
+  bs->state ^= bs->state >> 17;
+  bs->state ^= bs->state << 5;
+  return (uint8_t)(bs->state >> 24);
+}
+
+uint32_t hashBytes(const uint8_t* data, size_t size) {
+  uint32_t h = 2166136261u;
+  size_t i;
+  for(i=0; i < size; i++) {
+    h = (h ^ data[i]) * 16777619u;
+  }
+  return h ? h : 1;
+}
+
+/** Lay a straight run of one color, clipped at the edges of the grid */
+void layRun(Scenario* s, int x, int y, int dx, int dy, int len, int color) {
+  int i;
+  for(i=0; i < len; i++, x += dx, y += dy) {
+    if(x < 0 || x >= GRID_BLOCK_WIDTH || y < 0 || y >= GRID_BLOCK_HEIGHT) break;
+    s->cells[x][y] = color;
+  }
+}
+
+void decodeScenario(const uint8_t* data, size_t size, Scenario* s) {
+  uint8_t header[HEADER_SIZE] = {0};
+  memcpy(header, data, size < HEADER_SIZE ? size : HEADER_SIZE);
+  memset(s, 0, sizeof(*s));
+
+  ByteStream bs;
+  bs.data  = data + (size < HEADER_SIZE ? size : HEADER_SIZE);
+  bs.size  = size < HEADER_SIZE ? 0 : size - HEADER_SIZE;
+  bs.pos   = 0;
+  bs.state = hashBytes(data, size);
+
+  int gen = header[0] % GEN_COUNT;
+  int x, y, i;
+
+  s->columnX    = header[1] % GRID_BLOCK_WIDTH;
+  s->columnStep = header[2];
+  s->clampStep  = gen == GEN_RAW;
+  s->direction  = (header[6] & 1) ? 1 : -1;
+  for(i=0; i < BLOCK_COLUMN_LENGTH; i++) {
+    s->columnColors[i] = header[3+i] % NUM_COLORS + 1;
+  }
+
+  // Fewer colors means more matches
+  int colors  = 2 + (header[7] >> 6) % (NUM_COLORS - 1);
+  int density = header[7] & 0x3F;
+
+  switch(gen) {
+    case GEN_RAW:
+      for(i=0; i < RAW_SIZE && bs.pos < bs.size; i++) {
+        s->cells[i / GRID_BLOCK_HEIGHT][i % GRID_BLOCK_HEIGHT] =
+          nextByte(&bs) % (NUM_COLORS + 1);
+      }
+      break;
+
+    case GEN_NOISE:
+      bs.size = 0; // Only the seed matters
+      for(x=0; x < GRID_BLOCK_WIDTH; x++) {
+        for(y=0; y < GRID_BLOCK_HEIGHT; y++) {
+          if((nextByte(&bs) & 0x3F) < density) {
+            s->cells[x][y] = nextByte(&bs) % colors + 1;
+          }
+        }
+      }
+      break;
+
+    case GEN_RUNS: {
+      // Sparse noise with straight runs on top. Runs may start on an edge or
+      // corner and be longer than BLOCKS_TO_MATCH or the grid itself.
+      static const int dirs[4][2] = {{1,0}, {0,1}, {1,1}, {1,-1}};
+      int runs = 1 + nextByte(&bs) % 6;
+
+      for(x=0; x < GRID_BLOCK_WIDTH; x++) {
+        for(y=0; y < GRID_BLOCK_HEIGHT; y++) {
+          if((nextByte(&bs) & 0x3F) < density / 4) {
+            s->cells[x][y] = nextByte(&bs) % colors + 1;
+          }
+        }
+      }
+
+      for(i=0; i < runs; i++) {
+        uint8_t b0 = nextByte(&bs);
+        uint8_t b1 = nextByte(&bs);
+        uint8_t b2 = nextByte(&bs);
+        int d   = b0 & 3;
+        int len = BLOCKS_TO_MATCH - 1 + b1 % GRID_BLOCK_HEIGHT;
+        x = b2 % GRID_BLOCK_WIDTH;
+        y = (b2 >> 3) % GRID_BLOCK_HEIGHT;
+
+        // Snap the start onto an edge or a corner
+        if(b0 & 0x04) x = (b0 & 0x08) ? GRID_BLOCK_WIDTH-1 : 0;
+        if(b0 & 0x10) y = (b0 & 0x20) ? GRID_BLOCK_HEIGHT-1 : 0;
+
+        // Walk backwards for runs that would leave the grid immediately
+        int sign = (b0 & 0x40) ? -1 : 1;
+        layRun(s, x, y, sign * dirs[d][0], sign * dirs[d][1], len,
+               b1 % colors + 1);
+      }
+      break;
+    }
+
+    case GEN_STACKS:
+      for(x=0; x < GRID_BLOCK_WIDTH; x++) {
+        int height = nextByte(&bs) % (GRID_BLOCK_HEIGHT + 1);
+        for(y=GRID_BLOCK_HEIGHT-height; y < GRID_BLOCK_HEIGHT; y++) {
+          s->cells[x][y] = nextByte(&bs) % colors + 1;
+        }
+      }
+      break;
+  }
+}
+
+/** Encode a scenario as a GEN_RAW input so reproducers need no generator */
+size_t encodeScenario(const Scenario* s, int step, uint8_t* out) {
+  int i;
+  out[0] = GEN_RAW;
+  out[1] = s->columnX;
+  out[2] = step;
+  for(i=0; i < BLOCK_COLUMN_LENGTH; i++) {
+    out[3+i] = s->columnColors[i] - 1;
+  }
+  out[6] = s->direction > 0 ? 1 : 0;
+  out[7] = 0;
+  for(i=0; i < RAW_SIZE; i++) {
+    out[HEADER_SIZE+i] = s->cells[i / GRID_BLOCK_HEIGHT][i % GRID_BLOCK_HEIGHT];
+  }
+  return HEADER_SIZE + RAW_SIZE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Reference model
+///////////////////////////////////////////////////////////////////////////////
+
+/** Color a cell counts as in a line. The kernels treat every id above
+MAX_CELL_COLOR as MAX_CELL_COLOR. */
+int refColor(int cell) {
+  return cell > MAX_CELL_COLOR ? MAX_CELL_COLOR : cell;
+}
+
+/** Clear every block that is part of a straight line of at least match
+blocks of one color on a w x h board, column major. All lines are found on
+the board as it was before anything is cleared. */
+void refClear(int* cells, int w, int h, int match) {
+  static const int dirs[4][2] = {{1,0}, {0,1}, {1,1}, {1,-1}};
+  int marks[MAX_BOARD_WIDTH * MAX_BOARD_HEIGHT];
+  int x, y, d, i;
+
+  memset(marks, 0, sizeof(marks));
+
+  for(x=0; x < w; x++) {
+    for(y=0; y < h; y++) {
+      if(!cells[x*h + y]) continue;
+
+      for(d=0; d < 4; d++) {
+        int len = 0;
+        int cx  = x;
+        int cy  = y;
+        while(cx >= 0 && cx < w && cy >= 0 && cy < h &&
+              refColor(cells[cx*h + cy]) == refColor(cells[x*h + y])) {
+          len++;
+          cx += dirs[d][0];
+          cy += dirs[d][1];
+        }
+
+        if(len < match) continue;
+
+        for(i=0; i < len; i++) {
+          marks[(x + i*dirs[d][0])*h + y + i*dirs[d][1]] = 1;
+        }
+      }
+    }
+  }
+
+  for(i=0; i < w*h; i++) {
+    if(marks[i]) cells[i] = 0;
+  }
+}
+
+/** Drop every block of a w x h board straight down, keeping the order
+within each column */
+void refGravity(int* cells, int w, int h) {
+  int x, y;
+  for(x=0; x < w; x++) {
+    int dst = h - 1;
+    for(y=h-1; y >= 0; y--) {
+      if(cells[x*h + y]) {
+        int color = cells[x*h + y];
+        cells[x*h + y]   = 0;
+        cells[x*h + dst] = color;
+        dst--;
+      }
+    }
+  }
+}
+
+/** Row of the topmost block in a column, GRID_BLOCK_HEIGHT when empty */
+int refTop(int cells[GRID_BLOCK_WIDTH][GRID_BLOCK_HEIGHT], int x) {
+  int y;
+  for(y=0; y < GRID_BLOCK_HEIGHT; y++) {
+    if(cells[x][y]) return y;
+  }
+  return GRID_BLOCK_HEIGHT;
+}
+
+/** The grid row a column block belongs to. A falling block belongs to the
+slot its top edge is in; negative rows are above the grid. */
+int refColumnRow(const Scenario* s, int step, int c) {
+  int y = step * (BLOCK_HEIGHT/2) - (BLOCK_COLUMN_LENGTH-1-c) * BLOCK_HEIGHT;
+  return y < 0 ? -1 - (-y - 1) / BLOCK_HEIGHT : y / BLOCK_HEIGHT;
+}
+
+/** The column may shift sideways if it stays on the grid and every row it
+covers is free in the target column */
+int refCanShift(int cells[GRID_BLOCK_WIDTH][GRID_BLOCK_HEIGHT],
+                const Scenario* s, int step) {
+  int nx = s->columnX + s->direction;
+  int c;
+
+  if(nx < 0 || nx >= GRID_BLOCK_WIDTH) return false;
+
+  for(c=0; c < BLOCK_COLUMN_LENGTH; c++) {
+    int row = refColumnRow(s, step, c);
+    if(row >= 0 && cells[nx][row]) return false;
+  }
+  return true;
+}
+
+/** Land the column on top of its stack, then clear. Returns the game over
+flag: set when no free row is left above the landed column. */
+int refLand(int cells[GRID_BLOCK_WIDTH][GRID_BLOCK_HEIGHT], const Scenario* s) {
+  int top = refTop(cells, s->columnX);
+  int c;
+
+  for(c=0; c < BLOCK_COLUMN_LENGTH; c++) {
+    int row = top - BLOCK_COLUMN_LENGTH + c;
+    if(row >= 0) cells[s->columnX][row] = s->columnColors[c];
+  }
+
+  refClear(&cells[0][0], GRID_BLOCK_WIDTH, GRID_BLOCK_HEIGHT, BLOCKS_TO_MATCH);
+
+  return top - 1 - BLOCK_COLUMN_LENGTH <= 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Game state plumbing
+///////////////////////////////////////////////////////////////////////////////
+
+void loadBoard(int cells[GRID_BLOCK_WIDTH][GRID_BLOCK_HEIGHT]) {
+  int x, y;
+
+  initGameState();
+  gameOver = 0;
+
+  for(x=0; x < GRID_BLOCK_WIDTH; x++) {
+    for(y=0; y < GRID_BLOCK_HEIGHT; y++) {
+      placedBlocks[x][y].occupied = cells[x][y] != 0;
+      placedBlocks[x][y].x        = x * BLOCK_WIDTH;
+      placedBlocks[x][y].y        = y * BLOCK_HEIGHT;
+      placedBlocks[x][y].color    = cells[x][y] ? palette[cells[x][y]-1] : COLOR_BLACK;
+    }
+    occupiedSlots[x] = refTop(cells, x) < GRID_BLOCK_HEIGHT ? refTop(cells, x) - 1
+                                                            : GRID_BLOCK_HEIGHT;
+  }
+}
+
+/** Read placedBlocks back. Unknown colors come back as -1. */
+void readBoard(int cells[GRID_BLOCK_WIDTH][GRID_BLOCK_HEIGHT]) {
+  int x, y, i;
+  for(x=0; x < GRID_BLOCK_WIDTH; x++) {
+    for(y=0; y < GRID_BLOCK_HEIGHT; y++) {
+      cells[x][y] = 0;
+      if(!placedBlocks[x][y].occupied) continue;
+
+      cells[x][y] = -1;
+      for(i=0; i < NUM_COLORS; i++) {
+        if(placedBlocks[x][y].color == palette[i]) cells[x][y] = i + 1;
+      }
+    }
+  }
+}
+
+void loadColumn(const Scenario* s, int step) {
+  int c;
+  for(c=0; c < BLOCK_COLUMN_LENGTH; c++) {
+    // Any value other than true lets us notice spawnColumn() after a landing
+    columnBlocks[c].occupied = 2;
+    columnBlocks[c].x        = s->columnX * BLOCK_WIDTH;
+    columnBlocks[c].y        = step * (BLOCK_HEIGHT/2)
+                             - (BLOCK_COLUMN_LENGTH-1-c) * BLOCK_HEIGHT;
+    columnBlocks[c].color    = palette[s->columnColors[c]-1];
+  }
+}
+
+int sameBoard(int a[GRID_BLOCK_WIDTH][GRID_BLOCK_HEIGHT],
+              int b[GRID_BLOCK_WIDTH][GRID_BLOCK_HEIGHT]) {
+  return memcmp(a, b, sizeof(int) * RAW_SIZE) == 0;
+}
+
+void printBoards(int want[GRID_BLOCK_WIDTH][GRID_BLOCK_HEIGHT],
+                 int got[GRID_BLOCK_WIDTH][GRID_BLOCK_HEIGHT]) {
+  int x, y;
+  fprintf(stderr, "  reference%*s  kernel\n", GRID_BLOCK_WIDTH - 7, "");
+  for(y=0; y < GRID_BLOCK_HEIGHT; y++) {
+    fprintf(stderr, "  ");
+    for(x=0; x < GRID_BLOCK_WIDTH; x++) fputc(".12345"[want[x][y]], stderr);
+    fprintf(stderr, "    ");
+    for(x=0; x < GRID_BLOCK_WIDTH; x++) fputc(got[x][y] < 0 ? '?' : ".12345"[got[x][y]], stderr);
+    fprintf(stderr, "\n");
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Checks. Each returns 0 on agreement and prints the difference otherwise
+// when verbose is set.
+///////////////////////////////////////////////////////////////////////////////
+
+int checkClear(const Scenario* s, int verbose) {
+  int want[GRID_BLOCK_WIDTH][GRID_BLOCK_HEIGHT];
+  int got[GRID_BLOCK_WIDTH][GRID_BLOCK_HEIGHT];
+
+  memcpy(want, s->cells, sizeof(want));
+  refClear(&want[0][0], GRID_BLOCK_WIDTH, GRID_BLOCK_HEIGHT, BLOCKS_TO_MATCH);
+
+  loadBoard((int (*)[GRID_BLOCK_HEIGHT])s->cells);
+  clearAndScore();
+  readBoard(got);
+
+  if(sameBoard(want, got)) return 0;
+  if(verbose) printBoards(want, got);
+  return 1;
+}
+
+int checkCompact(const Scenario* s, int verbose) {
+  int want[GRID_BLOCK_WIDTH][GRID_BLOCK_HEIGHT];
+  int got[GRID_BLOCK_WIDTH][GRID_BLOCK_HEIGHT];
+  Block before[GRID_BLOCK_WIDTH][GRID_BLOCK_HEIGHT];
+  int x, y, tick;
+
+  memcpy(want, s->cells, sizeof(want));
+  refGravity(&want[0][0], GRID_BLOCK_WIDTH, GRID_BLOCK_HEIGHT);
+
+  loadBoard((int (*)[GRID_BLOCK_HEIGHT])s->cells);
+
+  // Tick until a whole interval passes without anything moving
+  for(tick=0; tick < MAX_TICKS; tick++) {
+    memcpy(before, placedBlocks, sizeof(before));
+    compactBlocks(tick * blockCompactingInterval);
+    if(memcmp(before, placedBlocks, sizeof(before)) == 0) break;
+  }
+
+  readBoard(got);
+
+  int failed = !sameBoard(want, got) || tick == MAX_TICKS;
+  for(x=0; x < GRID_BLOCK_WIDTH; x++) {
+    int top   = refTop(want, x);
+    int slots = top < GRID_BLOCK_HEIGHT ? top - 1 : GRID_BLOCK_HEIGHT;
+    if(occupiedSlots[x] != slots) {
+      if(verbose) fprintf(stderr, "  occupiedSlots[%d] = %d, want %d\n",
+                          x, occupiedSlots[x], slots);
+      failed = 1;
+    }
+    for(y=0; y < GRID_BLOCK_HEIGHT; y++) {
+      if(placedBlocks[x][y].occupied &&
+         (placedBlocks[x][y].x != x*BLOCK_WIDTH || placedBlocks[x][y].y != y*BLOCK_HEIGHT)) {
+        if(verbose) fprintf(stderr, "  block [%d][%d] drawn at %d,%d\n",
+                            x, y, placedBlocks[x][y].x, placedBlocks[x][y].y);
+        failed = 1;
+      }
+    }
+  }
+
+  if(failed && verbose) {
+    if(tick == MAX_TICKS) fprintf(stderr, "  board never settled\n");
+    printBoards(want, got);
+  }
+  return failed;
+}
+
+/** Column steps that are reachable on a settled board: the bottom block is
+on the grid and has not yet passed the top of its own stack. 0 when the
+column has nowhere to be. */
+int columnSteps(int settled[GRID_BLOCK_WIDTH][GRID_BLOCK_HEIGHT], const Scenario* s) {
+  int top = refTop(settled, s->columnX);
+  return top < 1 ? 0 : 2*(top-1) + 2;
+}
+
+int columnStep(int settled[GRID_BLOCK_WIDTH][GRID_BLOCK_HEIGHT], const Scenario* s) {
+  int steps = columnSteps(settled, s);
+  if(s->clampStep) return s->columnStep < steps ? s->columnStep : steps - 1;
+  return s->columnStep % steps;
+}
+
+int checkShift(const Scenario* s, int verbose) {
+  int settled[GRID_BLOCK_WIDTH][GRID_BLOCK_HEIGHT];
+  int c;
+
+  memcpy(settled, s->cells, sizeof(settled));
+  refGravity(&settled[0][0], GRID_BLOCK_WIDTH, GRID_BLOCK_HEIGHT);
+  if(!columnSteps(settled, s)) return 0;
+
+  int step = columnStep(settled, s);
+  int want = s->columnX + (refCanShift(settled, s, step) ? s->direction : 0);
+
+  loadBoard(settled);
+  loadColumn(s, step);
+  if(s->direction > 0) moveColumnRight();
+  else                 moveColumnLeft();
+
+  int failed = 0;
+  for(c=0; c < BLOCK_COLUMN_LENGTH; c++) {
+    if(columnBlocks[c].x != want * BLOCK_WIDTH) failed = 1;
+  }
+
+  if(failed && verbose) {
+    fprintf(stderr, "  column at x=%d bottom y=%d moving %s: want x=%d, got",
+            s->columnX, step * (BLOCK_HEIGHT/2), s->direction > 0 ? "right" : "left",
+            want);
+    for(c=0; c < BLOCK_COLUMN_LENGTH; c++) {
+      fprintf(stderr, " %d", columnBlocks[c].x / BLOCK_WIDTH);
+    }
+    fprintf(stderr, "\n");
+    printBoards(settled, settled);
+  }
+  return failed;
+}
+
+int checkLand(const Scenario* s, int verbose) {
+  int settled[GRID_BLOCK_WIDTH][GRID_BLOCK_HEIGHT];
+  int want[GRID_BLOCK_WIDTH][GRID_BLOCK_HEIGHT];
+  int got[GRID_BLOCK_WIDTH][GRID_BLOCK_HEIGHT];
+  int tick;
+
+  memcpy(settled, s->cells, sizeof(settled));
+  refGravity(&settled[0][0], GRID_BLOCK_WIDTH, GRID_BLOCK_HEIGHT);
+  if(!columnSteps(settled, s)) return 0;
+
+  int step = columnStep(settled, s);
+
+  memcpy(want, settled, sizeof(want));
+  int wantGameOver = refLand(want, s);
+
+  loadBoard(settled);
+  loadColumn(s, step);
+
+  for(tick=0; tick < MAX_TICKS; tick++) {
+    moveColumnDown(tick * columnDownInterval);
+    if(gameOver || columnBlocks[0].occupied != 2) break;
+  }
+
+  readBoard(got);
+
+  int failed = !sameBoard(want, got) || gameOver != wantGameOver;
+  if(failed && verbose) {
+    fprintf(stderr, "  column at x=%d bottom y=%d: game over %d, want %d\n",
+            s->columnX, step * (BLOCK_HEIGHT/2), gameOver, wantGameOver);
+    printBoards(want, got);
+  }
+  return failed;
+}
+
+/** Tile the scenario's board over a w x h board of kernel color ids */
+void tileBoard(const Scenario* s, const Shape* shape, Uint8* cells) {
+  int x, y;
+  for(x=0; x < shape->w; x++) {
+    for(y=0; y < shape->h; y++) {
+      int c = s->cells[x % GRID_BLOCK_WIDTH][y % GRID_BLOCK_HEIGHT];
+      if(shape->highIds && c == 4) c = MAX_CELL_COLOR;
+      if(shape->highIds && c == 5) c = MAX_CELL_COLOR + 1 + (x*31 + y*7) % (256 - MAX_CELL_COLOR - 1);
+      cells[x*shape->h + y] = c;
+    }
+  }
+}
+
+/** Run one match and settle kernel pair on a tiled board and compare both
+steps with the reference model */
+int checkShape(const Scenario* s, const Shape* shape, const char* name,
+               void (*match)(const Uint8*, Uint32*), int (*settle)(Uint8*), int verbose) {
+  Uint8  cells[MAX_BOARD_WIDTH * MAX_BOARD_HEIGHT];
+  Uint32 marks[MAX_BOARD_WIDTH];
+  int    want[MAX_BOARD_WIDTH * MAX_BOARD_HEIGHT];
+  int    n = shape->w * shape->h;
+  int    x, y, i;
+
+  tileBoard(s, shape, cells);
+  for(i=0; i < n; i++) want[i] = cells[i];
+
+  // Match, then clear what was marked
+  refClear(want, shape->w, shape->h, shape->match);
+  if(match) match(cells, marks);
+  else      findMatchesGeneric(cells, marks, shape->w, shape->h, shape->match);
+
+  for(x=0; x < shape->w; x++) {
+    for(y=0; y < shape->h; y++) {
+      if(marks[x] & (1u << y)) cells[x*shape->h + y] = 0;
+    }
+  }
+
+  const char* step = "match";
+  for(i=0; i < n && cells[i] == want[i]; i++);
+
+  // Settle what is left
+  if(i == n) {
+    int before[MAX_BOARD_WIDTH * MAX_BOARD_HEIGHT];
+    memcpy(before, want, n * sizeof(int));
+    refGravity(want, shape->w, shape->h);
+
+    int moved = settle ? settle(cells) : settleGeneric(cells, shape->w, shape->h);
+    step = "settle";
+    for(i=0; i < n && cells[i] == want[i]; i++);
+    if(i == n && moved != (memcmp(before, want, n * sizeof(int)) != 0)) {
+      if(verbose) fprintf(stderr, "  %s at %dx%d match %d: settle returned %d\n",
+                          name, shape->w, shape->h, shape->match, moved);
+      return 1;
+    }
+  }
+
+  if(i == n) return 0;
+
+  if(verbose) {
+    fprintf(stderr, "  %s at %dx%d match %d: %s leaves %d at %d,%d, want %d\n",
+            name, shape->w, shape->h, shape->match, step,
+            cells[i], i / shape->h, i % shape->h, want[i]);
+  }
+  return 1;
+}
+
+int checkShapes(const Scenario* s, int verbose) {
+  int i;
+
+  for(i=0; i < NUM_BOARD_KERNELS; i++) {
+    BoardKernel* k     = &boardKernels[i];
+    Shape        shape = {k->w, k->h, k->match, i & 1};
+
+    if(checkShape(s, &shape, k->name, k->findMatches, k->settle, verbose)) return 1;
+    if(checkShape(s, &shape, "generic", NULL, NULL, verbose))                return 1;
+  }
+
+  for(i=0; i < NUM_SHAPES; i++) {
+    if(checkShape(s, &shapes[i], "generic", NULL, NULL, verbose)) return 1;
+  }
+
+  return 0;
+}
+
+int (*checks[K_COUNT])(const Scenario*, int) = {
+  checkClear, checkCompact, checkShift, checkLand, checkShapes
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Reproducers
+///////////////////////////////////////////////////////////////////////////////
+
+/** Greedily empty cells while the kernel keeps disagreeing, then write the
+smallest failing scenario as a raw input that replays without the generator. */
+void reportMismatch(int kernel, const Scenario* found) {
+  Scenario s = *found;
+  int x, y, changed;
+
+  // Pin the column step so removing blocks cannot move the column
+  if(kernel == K_SHIFT || kernel == K_LAND) {
+    int settled[GRID_BLOCK_WIDTH][GRID_BLOCK_HEIGHT];
+    memcpy(settled, s.cells, sizeof(settled));
+    refGravity(&settled[0][0], GRID_BLOCK_WIDTH, GRID_BLOCK_HEIGHT);
+    s.columnStep = columnStep(settled, &s);
+    s.clampStep  = true;
+  }
+
+  do {
+    changed = false;
+    for(x=0; x < GRID_BLOCK_WIDTH; x++) {
+      for(y=0; y < GRID_BLOCK_HEIGHT; y++) {
+        if(!s.cells[x][y]) continue;
+        int color = s.cells[x][y];
+        s.cells[x][y] = 0;
+        if(checks[kernel](&s, false)) {
+          changed = true;
+        } else {
+          s.cells[x][y] = color;
+        }
+      }
+    }
+  } while(changed);
+
+  uint8_t repro[HEADER_SIZE + RAW_SIZE];
+  size_t  len = encodeScenario(&s, s.columnStep, repro);
+
+  char path[64];
+  snprintf(path, sizeof(path), "repro-%s-%08x.bin",
+           kernel == K_CLEAR ? "clear" : kernel == K_COMPACT ? "compact" :
+           kernel == K_SHIFT ? "shift" : kernel == K_LAND ? "land" : "shapes",
+           hashBytes(repro, len));
+
+  FILE* f = fopen(path, "wb");
+  if(f) {
+    fwrite(repro, 1, len, f);
+    fclose(f);
+  }
+
+  fprintf(stderr, "board_fuzz: %s disagrees with the reference model\n",
+          kernelNames[kernel]);
+  checks[kernel](&s, true);
+  fprintf(stderr, "board_fuzz: minimized reproducer written to %s\n",
+          f ? path : "(failed)");
+  abort();
+}
+
+int runInput(const uint8_t* data, size_t size) {
+  Scenario s;
+  int k;
+
+  decodeScenario(data, size, &s);
+
+  for(k=0; k < K_COUNT; k++) {
+    checksRun[k]++;
+    if(checks[k](&s, false)) reportMismatch(k, &s);
+  }
+  return 0;
+}
+
+void initPalette() {
+  palette[0] = COLOR_RED;
+  palette[1] = COLOR_GREEN;
+  palette[2] = COLOR_BLUE;
+  palette[3] = COLOR_ORANGE;
+  palette[4] = COLOR_YELLOW;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Entry points
+///////////////////////////////////////////////////////////////////////////////
+
+#ifdef BOARD_FUZZ_LIBFUZZER
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+  if(!palette[0]) initPalette();
+  return runInput(data, size);
+}
+
+#else
+
+/** Standalone driver. With files (or - for stdin) it replays them, which is
+also how afl-fuzz runs it (board_fuzz @@). Without files it runs random
+inputs for -n iterations from seed -s. */
+int main(int argc, char* argv[]) {
+  long     runs  = 100000;
+  uint32_t seed  = 1;
+  int      files = 0;
+  int      i, k;
+
+  initPalette();
+
+  for(i=1; i < argc; i++) {
+    if(strcmp(argv[i], "-n") == 0 && i+1 < argc) {
+      runs = atol(argv[++i]);
+    } else if(strcmp(argv[i], "-s") == 0 && i+1 < argc) {
+      seed = (uint32_t)strtoul(argv[++i], NULL, 10);
+    } else {
+      FILE* f = strcmp(argv[i], "-") == 0 ? stdin : fopen(argv[i], "rb");
+      if(!f) {
+        fprintf(stderr, "board_fuzz: cannot open %s\n", argv[i]);
+        return 1;
+      }
+
+      uint8_t buf[4096];
+      size_t  len = fread(buf, 1, sizeof(buf), f);
+      if(f != stdin) fclose(f);
+
+      runInput(buf, len);
+      files++;
+    }
+  }
+
+  if(!files) {
+    uint8_t  buf[HEADER_SIZE + RAW_SIZE + 32];
+    uint32_t state = seed ? seed : 1;
+    long     r;
+
+    for(r=0; r < runs; r++) {
+      size_t len = HEADER_SIZE + (state % (sizeof(buf) - HEADER_SIZE + 1));
+      size_t j;
+      for(j=0; j < len; j++) {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        buf[j] = (uint8_t)(state >> 24);
+      }
+      runInput(buf, len);
+    }
+  }
+
+  for(k=0; k < K_COUNT; k++) {
+    printf("%-22s %ld checks\n", kernelNames[k], checksRun[k]);
+  }
+  return 0;
+}
+
+#endif
@@ -0,0 +1,13 @@
+#!/bin/bash
+# Builds the board kernel fuzzer with ASan and UBSan.
+#   ./compile.sh            standalone driver, also runs under afl-fuzz (@@)
+#   ./compile.sh libfuzzer  libFuzzer target, needs clang
+cd "$(dirname "$0")"
+
+SAN="-fsanitize=address,undefined -fno-sanitize-recover=undefined"
+
+if [ "$1" == "libfuzzer" ]; then
+  clang -g -O1 $SAN -fsanitize=fuzzer -DBOARD_FUZZ_LIBFUZZER `sdl-config --cflags` board_fuzz.c `sdl-config --libs` -o board_fuzz
+else
+  ${CC:-gcc} -g -O1 $SAN `sdl-config --cflags` board_fuzz.c `sdl-config --libs` -o board_fuzz
+fi
@@ -0,0 +1,4 @@
+#!/bin/bash
+# Builds the dataset reader. It only needs dataset.h, not SDL.
+cd "$(dirname "$0")"
+${CC:-gcc} -O2 read_dataset.c -o read_dataset
@@ -0,0 +1,196 @@
+/*   read_dataset.c - reader for the placement datasets
+
+    Maps a dataset written by "blocks -record" and walks it block by block
+    with the structs from dataset.h. Raw columns are used straight out of
+    the mapping, only run length coded boards are expanded.
+
+    read_dataset file            summary of the whole file
+    read_dataset -dump file      one line per placement
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "../dataset.h"
+
+#define MAX_CHAIN 16
+
+/** Expand a DATASET_XOR_RLE column into width*count bytes. Returns 0 if the
+data runs short or long. */
+int decodeXorRle(const uint8_t* in, uint32_t size, uint32_t width, uint32_t count, uint8_t* out) {
+  uint32_t n = width * count;
+  uint32_t i = 0;
+  uint32_t p = 0;
+
+  while(p < size && i < n) {
+    uint8_t  c   = in[p++];
+    uint32_t len = (c & 0x7F) + 1;
+
+    if(i + len > n) return 0;
+    if(c & 0x80) {
+      memset(out + i, 0, len);
+    } else {
+      if(p + len > size) return 0;
+      memcpy(out + i, in + p, len);
+      p += len;
+    }
+    i += len;
+  }
+
+  if(i != n || p != size) return 0;
+
+  // Undo the differences, each record against the one before
+  for(i=width; i < n; i++) {
+    out[i] ^= out[i - width];
+  }
+
+  return 1;
+}
+
+int main(int argc, char* argv[]) {
+  const char* path = NULL;
+  int         dump = 0;
+  int         a;
+
+  for(a=1; a < argc; a++) {
+    if(strcmp(argv[a], "-dump") == 0) dump = 1;
+    else                              path = argv[a];
+  }
+
+  if(!path) {
+    fprintf(stderr, "usage: %s [-dump] file\n", argv[0]);
+    return 2;
+  }
+
+  int         fd = open(path, O_RDONLY);
+  struct stat st;
+  if(fd < 0 || fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(DatasetHeader)) {
+    fprintf(stderr, "%s: cannot read\n", path);
+    return 1;
+  }
+
+  size_t         fileSize = st.st_size;
+  const uint8_t* base     = mmap(NULL, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(base == MAP_FAILED) {
+    fprintf(stderr, "%s: cannot map\n", path);
+    return 1;
+  }
+
+  const DatasetHeader* header = (const DatasetHeader *)base;
+  if(memcmp(header->magic, DATASET_MAGIC, sizeof(header->magic)) != 0 ||
+     header->version != DATASET_VERSION) {
+    fprintf(stderr, "%s: not a version %d dataset\n", path, DATASET_VERSION);
+    return 1;
+  }
+
+  uint32_t boardSize = header->width * header->height;
+  uint8_t* boards    = malloc((size_t)boardSize * header->blockRecords);
+
+  long     records = 0, blocks = 0, games = 0, cleared = 0, rawBytes = 0;
+  long     chains[MAX_CHAIN+1] = {0};
+  long     columns[256]        = {0};
+  size_t   offset              = sizeof(DatasetHeader);
+  int      c;
+
+  while(offset < fileSize) {
+    const DatasetBlock* block = (const DatasetBlock *)(base + offset);
+
+    if(fileSize - offset < sizeof(DatasetBlock) || block->magic != DATASET_BLOCK_MAGIC ||
+       block->size < sizeof(DatasetBlock) || block->size > fileSize - offset ||
+       block->records > header->blockRecords) {
+      fprintf(stderr, "%s: bad block at %zu\n", path, offset);
+      return 1;
+    }
+
+    // Every column has to lie inside the block and hold whole records. Only
+    // the board may be run length coded, everything else is read in place.
+    for(c=0; c < DATASET_COLUMNS; c++) {
+      const DatasetColumn* col  = &block->columns[c];
+      uint32_t             want = block->records * datasetColumnWidth(header, c);
+      int                  rle  = col->encoding == DATASET_XOR_RLE;
+
+      if(col->offset % DATASET_ALIGN != 0 || col->offset > block->size ||
+         col->size > block->size - col->offset ||
+         (col->encoding != DATASET_RAW && !rle) ||
+         (rle && c != DATASET_BOARD) ||
+         (!rle && col->size != want)) {
+        fprintf(stderr, "%s: bad column %d in block at %zu\n", path, c, offset);
+        return 1;
+      }
+      rawBytes += want;
+    }
+
+    const uint8_t*  blockBase = base + offset;
+    const uint8_t*  board     = blockBase + block->columns[DATASET_BOARD].offset;
+    const uint8_t*  piece     = blockBase + block->columns[DATASET_PIECE].offset;
+    const uint8_t*  column    = blockBase + block->columns[DATASET_COLUMN].offset;
+    const uint8_t*  rotation  = blockBase + block->columns[DATASET_ROTATION].offset;
+    const uint16_t* clears    = (const uint16_t *)(blockBase + block->columns[DATASET_CLEARED].offset);
+    const uint8_t*  chain     = blockBase + block->columns[DATASET_CHAIN].offset;
+    const uint8_t*  ended     = blockBase + block->columns[DATASET_ENDED].offset;
+
+    if(block->columns[DATASET_BOARD].encoding == DATASET_XOR_RLE) {
+      if(!decodeXorRle(board, block->columns[DATASET_BOARD].size, boardSize, block->records, boards)) {
+        fprintf(stderr, "%s: bad board data in block at %zu\n", path, offset);
+        return 1;
+      }
+      board = boards;
+    }
+
+    uint32_t r;
+    for(r=0; r < block->records; r++) {
+      games   += ended[r];
+      cleared += clears[r];
+      chains[chain[r] < MAX_CHAIN ? chain[r] : MAX_CHAIN]++;
+      columns[column[r]]++;
+
+      if(dump) {
+        printf("%ld col %d rot %d cleared %d chain %d ended %d piece ",
+               records + r, column[r], rotation[r], clears[r], chain[r], ended[r]);
+        for(c=0; c < header->pieceLength; c++) {
+          putchar('0' + piece[r*header->pieceLength + c]);
+        }
+        printf(" board ");
+        for(c=0; c < (int)boardSize; c++) {
+          if(c > 0 && c % header->height == 0) putchar('/');
+          putchar('0' + board[r*boardSize + c]);
+        }
+        putchar('\n');
+      }
+    }
+
+    records += block->records;
+    blocks++;
+    offset  += block->size;
+  }
+
+  if(!dump) {
+    printf("%s: %dx%d board, piece of %d\n", path, header->width, header->height, header->pieceLength);
+    printf("  %ld placements in %ld blocks, %ld games ended\n", records, blocks, games);
+    printf("  %zu bytes on disk, %ld raw (%.1fx)\n", fileSize, rawBytes,
+           fileSize ? (double)rawBytes / fileSize : 0);
+    printf("  %ld blocks cleared, %.3f per placement\n", cleared,
+           records ? (double)cleared / records : 0);
+
+    printf("  chains:");
+    for(c=0; c <= MAX_CHAIN; c++) {
+      if(chains[c]) printf(" %d%s:%ld", c, c == MAX_CHAIN ? "+" : "", chains[c]);
+    }
+    printf("\n  columns:");
+    for(c=0; c < header->width; c++) {
+      printf(" %ld", columns[c]);
+    }
+    printf("\n");
+  }
+
+  free(boards);
+  munmap((void *)base, fileSize);
+
+  return 0;
+}